@@ -0,0 +1,91 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include "auth-stats.h"
+#include "comm.h"
+#include "log.h"
+
+// Bucket 0 counts checks under 1 ms, bucket n those from 2^(n-1) ms up to
+// 2^n ms, and the last one everything longer
+#define AUTH_STATS_BUCKETS 18
+
+struct latency_histogram {
+	const char *name;
+	uint32_t count;
+	// Sums and maximum, in microseconds
+	uint64_t total, auth, delay;
+	uint64_t max;
+	uint32_t buckets[AUTH_STATS_BUCKETS];
+};
+
+static struct latency_histogram histograms[] = {
+	{ .name = "failed" },
+	{ .name = "successful" },
+};
+
+static size_t get_bucket(uint64_t usec) {
+	uint64_t ms = usec / 1000;
+	size_t bucket = 0;
+	while (ms > 0 && bucket < AUTH_STATS_BUCKETS - 1) {
+		ms >>= 1;
+		++bucket;
+	}
+	return bucket;
+}
+
+void auth_stats_record(bool success, uint64_t total,
+		const struct comm_timing *timing) {
+	struct latency_histogram *histogram = &histograms[success];
+	uint64_t child = timing->auth + timing->delay;
+	uint64_t overhead = total > child ? total - child : 0;
+	swaylock_log(LOG_DEBUG, "Password check %s after %llu ms: "
+		"%llu ms checking, %llu ms fail delay, %llu ms overhead",
+		success ? "succeeded" : "failed",
+		(unsigned long long)(total / 1000),
+		(unsigned long long)(timing->auth / 1000),
+		(unsigned long long)(timing->delay / 1000),
+		(unsigned long long)(overhead / 1000));
+
+	++histogram->count;
+	histogram->total += total;
+	histogram->auth += timing->auth;
+	histogram->delay += timing->delay;
+	if (total > histogram->max) {
+		histogram->max = total;
+	}
+	++histogram->buckets[get_bucket(total)];
+}
+
+void auth_stats_log(void) {
+	for (size_t i = 0; i < sizeof(histograms) / sizeof(histograms[0]); ++i) {
+		struct latency_histogram *histogram = &histograms[i];
+		if (histogram->count == 0) {
+			continue;
+		}
+		swaylock_log(LOG_INFO, "%u %s password checks: mean %llu ms "
+			"(%llu ms checking, %llu ms fail delay), max %llu ms",
+			histogram->count, histogram->name,
+			(unsigned long long)(histogram->total / histogram->count / 1000),
+			(unsigned long long)(histogram->auth / histogram->count / 1000),
+			(unsigned long long)(histogram->delay / histogram->count / 1000),
+			(unsigned long long)(histogram->max / 1000));
+
+		for (size_t bucket = 0; bucket < AUTH_STATS_BUCKETS; ++bucket) {
+			if (histogram->buckets[bucket] == 0) {
+				continue;
+			}
+			char range[32];
+			if (bucket == 0) {
+				snprintf(range, sizeof(range), "< 1 ms");
+			} else if (bucket == AUTH_STATS_BUCKETS - 1) {
+				snprintf(range, sizeof(range), ">= %llu ms",
+					1ULL << (bucket - 1));
+			} else {
+				snprintf(range, sizeof(range), "%llu-%llu ms",
+					1ULL << (bucket - 1), (1ULL << bucket) - 1);
+			}
+			swaylock_log(LOG_INFO, "  %12s: %u", range,
+				histogram->buckets[bucket]);
+		}
+	}
+}
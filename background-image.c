@@ -1,7 +1,12 @@
 #include <assert.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 #include "background-image.h"
 #include "cairo.h"
 #include "log.h"
+#include "trace.h"
 
 enum background_mode parse_background_mode(const char *mode) {
 	if (strcmp(mode, "stretch") == 0) {
@@ -21,6 +26,69 @@ enum background_mode parse_background_mode(const char *mode) {
 	return BACKGROUND_MODE_INVALID;
 }
 
+enum image_alpha {
+	IMAGE_ALPHA_OPAQUE, // all pixels are opaque
+	IMAGE_ALPHA_BINARY, // all pixels are either opaque or fully transparent
+	IMAGE_ALPHA_FULL,
+};
+
+static enum image_alpha scan_alpha(cairo_surface_t *image) {
+	if (cairo_image_surface_get_format(image) != CAIRO_FORMAT_ARGB32) {
+		return cairo_surface_get_content(image) == CAIRO_CONTENT_COLOR ?
+			IMAGE_ALPHA_OPAQUE : IMAGE_ALPHA_FULL;
+	}
+
+	cairo_surface_flush(image);
+	const unsigned char *data = cairo_image_surface_get_data(image);
+	int width = cairo_image_surface_get_width(image);
+	int height = cairo_image_surface_get_height(image);
+	int stride = cairo_image_surface_get_stride(image);
+
+	uint32_t opaque = 0xff;
+	for (int y = 0; y < height; ++y) {
+		const uint32_t *row = (const uint32_t *)(data + (size_t)y * stride);
+		// Without branches in the loop, so that the compiler vectorizes it.
+		// An alpha of 0 or 255 plus one has none of the bits in 0xfe set.
+		uint32_t partial = 0;
+		for (int x = 0; x < width; ++x) {
+			uint32_t alpha = row[x] >> 24;
+			opaque &= alpha;
+			partial |= (alpha + 1) & 0xfe;
+		}
+		if (partial) {
+			return IMAGE_ALPHA_FULL;
+		}
+	}
+	return opaque == 0xff ? IMAGE_ALPHA_OPAQUE : IMAGE_ALPHA_BINARY;
+}
+
+// Converts an image whose pixels are all opaque to a format without alpha
+static cairo_surface_t *drop_alpha(cairo_surface_t *image) {
+	int width = cairo_image_surface_get_width(image);
+	int height = cairo_image_surface_get_height(image);
+	cairo_surface_t *opaque =
+		cairo_image_surface_create(CAIRO_FORMAT_RGB24, width, height);
+	if (cairo_surface_status(opaque) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(opaque);
+		return image;
+	}
+
+	// Opaque premultiplied ARGB32 pixels are valid RGB24 pixels
+	const unsigned char *src = cairo_image_surface_get_data(image);
+	int src_stride = cairo_image_surface_get_stride(image);
+	unsigned char *dst = cairo_image_surface_get_data(opaque);
+	int dst_stride = cairo_image_surface_get_stride(opaque);
+	cairo_surface_flush(opaque);
+	for (int y = 0; y < height; ++y) {
+		memcpy(dst + (size_t)y * dst_stride, src + (size_t)y * src_stride,
+			(size_t)width * 4);
+	}
+	cairo_surface_mark_dirty(opaque);
+
+	cairo_surface_destroy(image);
+	return opaque;
+}
+
 cairo_surface_t *load_background_image(const char *path) {
 	cairo_surface_t *image;
 #if HAVE_GDK_PIXBUF
@@ -53,14 +121,473 @@ cairo_surface_t *load_background_image(const char *path) {
 				, cairo_status_to_string(cairo_surface_status(image)));
 		return NULL;
 	}
+
+	// Images are often saved with an alpha channel which they do not use
+	switch (scan_alpha(image)) {
+	case IMAGE_ALPHA_OPAQUE:
+		if (cairo_image_surface_get_format(image) == CAIRO_FORMAT_ARGB32) {
+			swaylock_log(LOG_DEBUG, "Background image is opaque");
+			image = drop_alpha(image);
+		}
+		break;
+	case IMAGE_ALPHA_BINARY:
+		swaylock_log(LOG_DEBUG, "Background image has binary alpha");
+		break;
+	case IMAGE_ALPHA_FULL:
+		break;
+	}
 	return image;
 }
 
+// Computes where the image is drawn on the buffer, in buffer pixels. The tile
+// mode is treated as covering the buffer.
+static void get_image_placement(cairo_surface_t *image, enum background_mode mode,
+		int buffer_width, int buffer_height,
+		double *x, double *y, double *width, double *height) {
+	double image_width = cairo_image_surface_get_width(image);
+	double image_height = cairo_image_surface_get_height(image);
+	double window_ratio = (double)buffer_width / buffer_height;
+	double bg_ratio = image_width / image_height;
+
+	switch (mode) {
+	case BACKGROUND_MODE_STRETCH:
+		*width = buffer_width;
+		*height = buffer_height;
+		break;
+	case BACKGROUND_MODE_FILL:
+	case BACKGROUND_MODE_FIT: {
+		// Fill scales to the larger of both ratios, and fit to the smaller
+		bool width_first = (window_ratio > bg_ratio) ==
+			(mode == BACKGROUND_MODE_FILL);
+		double scale = width_first ? (double)buffer_width / image_width :
+			(double)buffer_height / image_height;
+		*width = image_width * scale;
+		*height = image_height * scale;
+		break;
+	}
+	case BACKGROUND_MODE_CENTER:
+		*x = (int)((double)buffer_width / 2 - image_width / 2);
+		*y = (int)((double)buffer_height / 2 - image_height / 2);
+		*width = image_width;
+		*height = image_height;
+		return;
+	default:
+		*x = *y = 0;
+		*width = buffer_width;
+		*height = buffer_height;
+		return;
+	}
+	*x = ((double)buffer_width - *width) / 2;
+	*y = ((double)buffer_height - *height) / 2;
+}
+
+// Largest factor handled by the integer scaling paths
+#define MAX_INTEGER_FACTOR 64
+
+/**
+ * Returns the factor by which the image is scaled up (positive) or down
+ * (negative) to the given size, or 0 if it is not the same integer in both
+ * directions.
+ */
+static int get_integer_factor(cairo_surface_t *image,
+		double width, double height) {
+	int image_width = cairo_image_surface_get_width(image);
+	int image_height = cairo_image_surface_get_height(image);
+	if (width != floor(width) || height != floor(height) ||
+			width < 1 || height < 1) {
+		return 0;
+	}
+	if (width > image_width) {
+		int factor = width / image_width;
+		if (factor <= MAX_INTEGER_FACTOR &&
+				image_width * factor == width &&
+				image_height * factor == height) {
+			return factor;
+		}
+	} else if (width < image_width) {
+		int factor = image_width / width;
+		if (factor <= MAX_INTEGER_FACTOR &&
+				width * factor == image_width &&
+				height * factor == image_height) {
+			return -factor;
+		}
+	}
+	return 0;
+}
+
+// Strides are in pixels. Each pixel of the source becomes a block of
+// factor x factor pixels. The size is the one of the destination, which starts
+// at the given offset in the scaled image, and alpha is set in every pixel
+// written.
+static void upscale_nearest(const uint32_t *restrict src, int src_stride,
+		uint32_t *restrict dst, int dst_stride, int width, int height,
+		int x_offset, int y_offset, int factor, uint32_t alpha) {
+	for (int y = 0; y < height; ++y) {
+		uint32_t *dst_row = dst + (size_t)y * dst_stride;
+		// The other rows of a block are the same as its first one
+		if (y > 0 && (y + y_offset) % factor != 0) {
+			memcpy(dst_row, dst_row - dst_stride, (size_t)width * sizeof(uint32_t));
+			continue;
+		}
+		const uint32_t *src_row = src + (size_t)((y + y_offset) / factor) * src_stride;
+		int sx = x_offset / factor;
+		int k = x_offset % factor;
+		for (int x = 0; x < width; ++x) {
+			dst_row[x] = src_row[sx] | alpha;
+			if (++k == factor) {
+				k = 0;
+				++sx;
+			}
+		}
+	}
+}
+
+// Strides are in pixels, and the size is the one of the destination. Each
+// pixel of the destination is the average of a block of factor x factor
+// pixels, which is correct since cairo premultiplies alpha. Each channel is
+// averaged on its own, so the pixels are handled as bytes: the rows of a block
+// are first summed bytewise, which the compiler vectorizes, and then the
+// columns. sums must hold the bytes of a source row, and alpha is set in every
+// pixel written.
+static void downscale_box(const uint32_t *restrict src, int src_stride,
+		int width, int height, uint32_t *restrict dst, int dst_stride, int factor,
+		uint32_t alpha, uint32_t *restrict sums) {
+	size_t row_bytes = (size_t)width * factor * 4;
+	uint32_t area = factor * factor;
+	for (int y = 0; y < height; ++y) {
+		memset(sums, 0, row_bytes * sizeof(uint32_t));
+		for (int k = 0; k < factor; ++k) {
+			const uint8_t *src_row = (const uint8_t *)
+				(src + ((size_t)y * factor + k) * src_stride);
+			for (size_t i = 0; i < row_bytes; ++i) {
+				sums[i] += src_row[i];
+			}
+		}
+
+		uint8_t *dst_row = (uint8_t *)(dst + (size_t)y * dst_stride);
+		for (int x = 0; x < width; ++x) {
+			for (int c = 0; c < 4; ++c) {
+				uint32_t sum = 0;
+				for (int j = 0; j < factor; ++j) {
+					sum += sums[((size_t)x * factor + j) * 4 + c];
+				}
+				dst_row[x * 4 + c] = (sum + area / 2) / area;
+			}
+		}
+		if (alpha) {
+			for (int x = 0; x < width; ++x) {
+				dst[(size_t)y * dst_stride + x] |= alpha;
+			}
+		}
+	}
+}
+
+// Scales the image by the factor from get_integer_factor()
+static cairo_surface_t *scale_image_integer(cairo_surface_t *image, int factor) {
+	cairo_format_t format = cairo_image_surface_get_format(image);
+	if (format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24) {
+		return NULL;
+	}
+	int width = cairo_image_surface_get_width(image);
+	int height = cairo_image_surface_get_height(image);
+	int scaled_width = factor > 0 ? width * factor : width / -factor;
+	int scaled_height = factor > 0 ? height * factor : height / -factor;
+
+	cairo_surface_t *scaled =
+		cairo_image_surface_create(format, scaled_width, scaled_height);
+	if (cairo_surface_status(scaled) != CAIRO_STATUS_SUCCESS) {
+		cairo_surface_destroy(scaled);
+		return NULL;
+	}
+
+	cairo_surface_flush(image);
+	cairo_surface_flush(scaled);
+	const uint32_t *src = (const uint32_t *)cairo_image_surface_get_data(image);
+	int src_stride = cairo_image_surface_get_stride(image) / 4;
+	uint32_t *dst = (uint32_t *)cairo_image_surface_get_data(scaled);
+	int dst_stride = cairo_image_surface_get_stride(scaled) / 4;
+	if (factor > 0) {
+		upscale_nearest(src, src_stride, dst, dst_stride,
+			scaled_width, scaled_height, 0, 0, factor, 0);
+	} else {
+		uint32_t *sums = malloc((size_t)width * 4 * sizeof(uint32_t));
+		if (!sums) {
+			cairo_surface_destroy(scaled);
+			return NULL;
+		}
+		downscale_box(src, src_stride, scaled_width, scaled_height,
+			dst, dst_stride, -factor, 0, sums);
+		free(sums);
+	}
+	cairo_surface_mark_dirty(scaled);
+	return scaled;
+}
+
+/**
+ * Scales the image by the factor from get_integer_factor() straight into the
+ * pixels of the cairo target, at the given position in user space, without a
+ * scaled copy of the whole image. This only gives the same pixels as painting
+ * the image when it is opaque, is moved by whole pixels, is not clipped, and
+ * the target is a 32-bit image surface, so this returns false otherwise.
+ */
+static bool scale_image_into_target(cairo_t *cairo, cairo_surface_t *image,
+		int factor, double x, double y) {
+	cairo_surface_t *target = cairo_get_group_target(cairo);
+	if (cairo_image_surface_get_format(image) != CAIRO_FORMAT_RGB24 ||
+			cairo_surface_get_type(target) != CAIRO_SURFACE_TYPE_IMAGE) {
+		return false;
+	}
+	cairo_format_t format = cairo_image_surface_get_format(target);
+	cairo_operator_t op = cairo_get_operator(cairo);
+	if ((format != CAIRO_FORMAT_ARGB32 && format != CAIRO_FORMAT_RGB24) ||
+			(op != CAIRO_OPERATOR_OVER && op != CAIRO_OPERATOR_SOURCE)) {
+		return false;
+	}
+	double offset_x, offset_y;
+	cairo_surface_get_device_offset(target, &offset_x, &offset_y);
+	if (offset_x != 0 || offset_y != 0) {
+		return false;
+	}
+
+	// Only a translation by whole pixels from user to target pixels
+	double dx = 1, dy = 0;
+	cairo_user_to_device_distance(cairo, &dx, &dy);
+	if (dx != 1 || dy != 0) {
+		return false;
+	}
+	dx = 0;
+	dy = 1;
+	cairo_user_to_device_distance(cairo, &dx, &dy);
+	if (dx != 0 || dy != 1) {
+		return false;
+	}
+	cairo_user_to_device(cairo, &x, &y);
+	if (x != floor(x) || y != floor(y)) {
+		return false;
+	}
+
+	int target_width = cairo_image_surface_get_width(target);
+	int target_height = cairo_image_surface_get_height(target);
+	double clip_x0, clip_y0, clip_x1, clip_y1;
+	cairo_clip_extents(cairo, &clip_x0, &clip_y0, &clip_x1, &clip_y1);
+	cairo_user_to_device(cairo, &clip_x0, &clip_y0);
+	cairo_user_to_device(cairo, &clip_x1, &clip_y1);
+	if (clip_x0 > 0 || clip_y0 > 0 ||
+			clip_x1 < target_width || clip_y1 < target_height) {
+		return false;
+	}
+
+	int width = cairo_image_surface_get_width(image);
+	int height = cairo_image_surface_get_height(image);
+	int scaled_width = factor > 0 ? width * factor : width / -factor;
+	int scaled_height = factor > 0 ? height * factor : height / -factor;
+	// The part of the scaled image which is on the target
+	int x0 = fmax(x, 0);
+	int y0 = fmax(y, 0);
+	int x1 = fmin(x + scaled_width, target_width);
+	int y1 = fmin(y + scaled_height, target_height);
+	if (x1 <= x0 || y1 <= y0) {
+		return true;
+	}
+
+	uint32_t *sums = NULL;
+	if (factor < 0) {
+		sums = malloc((size_t)(x1 - x0) * -factor * 4 * sizeof(uint32_t));
+		if (!sums) {
+			return false;
+		}
+	}
+
+	cairo_surface_flush(image);
+	cairo_surface_flush(target);
+	const uint32_t *src = (const uint32_t *)cairo_image_surface_get_data(image);
+	int src_stride = cairo_image_surface_get_stride(image) / 4;
+	uint32_t *dst = (uint32_t *)cairo_image_surface_get_data(target);
+	int dst_stride = cairo_image_surface_get_stride(target) / 4;
+	dst += (size_t)y0 * dst_stride + x0;
+	// The unused byte of RGB24 pixels is undefined, and is alpha in ARGB32
+	uint32_t alpha = 0xff000000;
+	if (factor > 0) {
+		upscale_nearest(src, src_stride, dst, dst_stride, x1 - x0, y1 - y0,
+			x0 - (int)x, y0 - (int)y, factor, alpha);
+	} else {
+		src += (size_t)(y0 - (int)y) * -factor * src_stride +
+			(size_t)(x0 - (int)x) * -factor;
+		downscale_box(src, src_stride, x1 - x0, y1 - y0,
+			dst, dst_stride, -factor, alpha, sums);
+		free(sums);
+	}
+	cairo_surface_mark_dirty_rectangle(target, x0, y0, x1 - x0, y1 - y0);
+	return true;
+}
+
+// Draws the image with the integer scaling paths, if they apply
+static bool render_background_image_integer(cairo_t *cairo,
+		cairo_surface_t *image, enum background_mode mode,
+		int buffer_width, int buffer_height) {
+	if (mode != BACKGROUND_MODE_STRETCH && mode != BACKGROUND_MODE_FILL &&
+			mode != BACKGROUND_MODE_FIT) {
+		return false;
+	}
+	double x, y, width, height;
+	get_image_placement(image, mode, buffer_width, buffer_height,
+		&x, &y, &width, &height);
+	int factor = get_integer_factor(image, width, height);
+	if (factor == 0 || x != floor(x) || y != floor(y)) {
+		return false;
+	}
+
+	trace_begin("scale_integer");
+	if (scale_image_into_target(cairo, image, factor, x, y)) {
+		trace_end("scale_integer");
+		return true;
+	}
+	cairo_surface_t *scaled = scale_image_integer(image, factor);
+	if (!scaled) {
+		trace_end("scale_integer");
+		return false;
+	}
+	cairo_save(cairo);
+	cairo_set_source_surface(cairo, scaled, x, y);
+	cairo_paint(cairo);
+	cairo_restore(cairo);
+	cairo_surface_destroy(scaled);
+	trace_end("scale_integer");
+	return true;
+}
+
+// Cairo images are at most 32767 pixels wide
+#define MAX_IMAGE_LEVELS 15
+
+// Successive halvings of an image, built once and kept with it until
+// release_background_image_levels()
+struct image_levels {
+	int count;
+	cairo_surface_t *levels[MAX_IMAGE_LEVELS];
+};
+
+static const cairo_user_data_key_t image_levels_key;
+
+static void destroy_image_levels(void *data) {
+	struct image_levels *levels = data;
+	for (int i = 0; i < levels->count; ++i) {
+		cairo_surface_destroy(levels->levels[i]);
+	}
+	free(levels);
+}
+
+static struct image_levels *get_image_levels(cairo_surface_t *image) {
+	struct image_levels *levels =
+		cairo_surface_get_user_data(image, &image_levels_key);
+	if (levels) {
+		return levels;
+	}
+	levels = calloc(1, sizeof(struct image_levels));
+	if (!levels) {
+		return NULL;
+	}
+
+	trace_begin("build_levels");
+	// Odd sizes are rounded down, dropping the last row or column
+	cairo_surface_t *source = image;
+	while (levels->count < MAX_IMAGE_LEVELS &&
+			cairo_image_surface_get_width(source) >= 2 &&
+			cairo_image_surface_get_height(source) >= 2) {
+		cairo_surface_t *level = scale_image_integer(source, -2);
+		if (!level) {
+			break;
+		}
+		levels->levels[levels->count++] = level;
+		source = level;
+	}
+	trace_end("build_levels");
+
+	if (levels->count == 0 || cairo_surface_set_user_data(image,
+			&image_levels_key, levels, destroy_image_levels)
+			!= CAIRO_STATUS_SUCCESS) {
+		destroy_image_levels(levels);
+		return NULL;
+	}
+	swaylock_log(LOG_DEBUG, "Built %d levels for %dx%d image", levels->count,
+		cairo_image_surface_get_width(image),
+		cairo_image_surface_get_height(image));
+	return levels;
+}
+
+// Draws the image from the smallest of its levels which is not smaller than
+// the target, if the image is at least twice as large as the target. Cairo
+// then never scales by less than a half, where a bilinear filter is enough.
+static bool render_background_image_levels(cairo_t *cairo,
+		cairo_surface_t *image, enum background_mode mode,
+		int buffer_width, int buffer_height) {
+	if (mode != BACKGROUND_MODE_STRETCH && mode != BACKGROUND_MODE_FILL &&
+			mode != BACKGROUND_MODE_FIT) {
+		return false;
+	}
+	double x, y, width, height;
+	get_image_placement(image, mode, buffer_width, buffer_height,
+		&x, &y, &width, &height);
+	if (width * 2 > cairo_image_surface_get_width(image) ||
+			height * 2 > cairo_image_surface_get_height(image)) {
+		return false;
+	}
+	struct image_levels *levels = get_image_levels(image);
+	if (!levels) {
+		return false;
+	}
+
+	cairo_surface_t *level = NULL;
+	for (int i = 0; i < levels->count; ++i) {
+		if (cairo_image_surface_get_width(levels->levels[i]) < width ||
+				cairo_image_surface_get_height(levels->levels[i]) < height) {
+			break;
+		}
+		level = levels->levels[i];
+	}
+	if (!level) {
+		return false;
+	}
+
+	trace_begin("scale_levels");
+	cairo_save(cairo);
+	cairo_translate(cairo, x, y);
+	cairo_scale(cairo, width / cairo_image_surface_get_width(level),
+		height / cairo_image_surface_get_height(level));
+	cairo_set_source_surface(cairo, level, 0, 0);
+	cairo_pattern_set_filter(cairo_get_source(cairo), CAIRO_FILTER_BILINEAR);
+	cairo_paint(cairo);
+	cairo_restore(cairo);
+	trace_end("scale_levels");
+	return true;
+}
+
+void release_background_image_levels(cairo_surface_t *image) {
+	cairo_surface_set_user_data(image, &image_levels_key, NULL, NULL);
+}
+
 void render_background_image(cairo_t *cairo, cairo_surface_t *image,
 		enum background_mode mode, int buffer_width, int buffer_height) {
+	// Exact integer ratios are sharper and faster without cairo's filters
+	if (render_background_image_integer(cairo, image, mode,
+			buffer_width, buffer_height)) {
+		return;
+	}
+	// Large downscales start from a smaller copy of the image
+	if (render_background_image_levels(cairo, image, mode,
+			buffer_width, buffer_height)) {
+		return;
+	}
+
+	render_background_image_cairo(cairo, image, mode,
+		buffer_width, buffer_height);
+}
+
+void render_background_image_cairo(cairo_t *cairo, cairo_surface_t *image,
+		enum background_mode mode, int buffer_width, int buffer_height) {
 	double width = cairo_image_surface_get_width(image);
 	double height = cairo_image_surface_get_height(image);
 
+	trace_begin("scale_cairo");
 	cairo_save(cairo);
 	switch (mode) {
 	case BACKGROUND_MODE_STRETCH:
@@ -126,4 +653,26 @@ void render_background_image(cairo_t *cairo, cairo_surface_t *image,
 	}
 	cairo_paint(cairo);
 	cairo_restore(cairo);
+	trace_end("scale_cairo");
+}
+
+bool get_background_image_box(cairo_surface_t *image, enum background_mode mode,
+		int buffer_width, int buffer_height,
+		int *x, int *y, int *width, int *height) {
+	double x0, y0, x1, y1;
+	get_image_placement(image, mode, buffer_width, buffer_height,
+		&x0, &y0, &x1, &y1);
+	x1 += x0;
+	y1 += y0;
+	bool exact = x0 == floor(x0) && y0 == floor(y0) &&
+		x1 == floor(x1) && y1 == floor(y1);
+
+	*x = fmax(floor(x0), 0);
+	*y = fmax(floor(y0), 0);
+	*width = fmin(ceil(x1), buffer_width) - *x;
+	*height = fmin(ceil(y1), buffer_height) - *y;
+	if (*width < 0 || *height < 0) {
+		*width = *height = 0;
+	}
+	return exact;
 }
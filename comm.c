@@ -1,145 +1,565 @@
+#undef _POSIX_C_SOURCE
+#define _GNU_SOURCE // for memfd_create() and file seals
 #include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
 #include <signal.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
 #include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <time.h>
 #include <unistd.h>
 #include "comm.h"
 #include "log.h"
 #include "swaylock.h"
 #include "password-buffer.h"
+#include "probe.h"
+#include "trace.h"
 
-static int comm[2][2] = {{-1, -1}, {-1, -1}};
+/*
+ * swaylock and the password checking child talk over a SOCK_SEQPACKET socket
+ * pair, so each message is delivered whole. Every message starts with a
+ * header identifying the request it is about:
+ *
+ *   REQUEST  swaylock -> child  header + NUL-terminated password, or only the
+ *                               header with the size of the password as value
+ *                               if it was written to the shared region
+ *   CANCEL   swaylock -> child  header, only sent to authenticators
+ *   STATUS   child -> swaylock  header + NUL-terminated message
+ *   RESULT   child -> swaylock  header, with the enum comm_result as value,
+ *                               optionally followed by struct comm_timing
+ *
+ * When supported, swaylock and the password checking child share a sealed,
+ * locked memfd region, so that the password does not go through the socket.
+ * It holds at most one password at a time, and is wiped once the result of
+ * its request has been received.
+ *
+ * Authenticator children use the same messages over their own socket pair,
+ * but start authenticating as soon as they are spawned instead of waiting for
+ * a request. Their messages use the ID 0, and a CANCEL tells them to stop.
+ */
 
-static ssize_t read_full(int fd, void *dst, size_t size) {
-	char *buf = dst;
-	size_t offset = 0;
-	while (offset < size) {
-		ssize_t n = read(fd, &buf[offset], size - offset);
-		if (n < 0) {
-			if (errno == EINTR) {
-				continue;
-			}
-			swaylock_log_errno(LOG_ERROR, "read() failed");
-			return -1;
-		} else if (n == 0) {
-			if (offset == 0) {
-				return 0;
-			}
-			swaylock_log(LOG_ERROR, "read() failed: unexpected EOF");
-			return -1;
-		}
-		offset += n;
+enum comm_message_type {
+	COMM_MESSAGE_REQUEST,
+	COMM_MESSAGE_CANCEL,
+	COMM_MESSAGE_STATUS,
+	COMM_MESSAGE_RESULT,
+};
+
+struct comm_header {
+	uint32_t type;
+	uint32_t id;
+	uint32_t value;
+};
+
+#define COMM_AUTHENTICATORS_MAX 4
+
+// comm[0] is used by swaylock, comm[1] by the password checking child. In an
+// authenticator child, comm[1] is its end of its own socket pair.
+static int comm[2] = {-1, -1};
+
+static struct comm_channel authenticators[COMM_AUTHENTICATORS_MAX];
+static size_t authenticators_len = 0;
+
+static char *shared = NULL;
+static size_t shared_size = 0;
+// ID of the request whose password is in the shared region, or 0
+static uint32_t shared_request = 0;
+
+static bool write_message(int fd, uint32_t type, uint32_t id, uint32_t value,
+		const void *payload, size_t size) {
+	struct comm_header header = {
+		.type = type,
+		.id = id,
+		.value = value,
+	};
+	struct iovec iov[2] = {
+		{ .iov_base = &header, .iov_len = sizeof(header) },
+		{ .iov_base = (void *)payload, .iov_len = size },
+	};
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = payload ? 2 : 1,
+	};
+	ssize_t n;
+	do {
+		// The other end may already have exited, which must not kill us
+		n = sendmsg(fd, &msg, MSG_NOSIGNAL);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		swaylock_log_errno(LOG_ERROR, "sendmsg() failed");
+		return false;
 	}
-	return offset;
+	assert((size_t)n == sizeof(header) + size);
+	return true;
 }
 
-static bool write_full(int fd, const void *src, size_t size) {
-	const char *buf = src;
-	size_t offset = 0;
-	while (offset < size) {
-		ssize_t n = write(fd, &buf[offset], size - offset);
-		if (n <= 0) {
-			assert(n != 0);
-			if (errno == EINTR) {
-				continue;
-			}
-			swaylock_log_errno(LOG_ERROR, "write() failed");
-			return false;
-		}
-		offset += n;
+// Returns the size of the message including its header, 0 if the other end
+// was closed, or -1 on error.
+static ssize_t read_message(int fd, struct comm_header *header,
+		void *payload, size_t size) {
+	struct iovec iov[2] = {
+		{ .iov_base = header, .iov_len = sizeof(*header) },
+		{ .iov_base = payload, .iov_len = size },
+	};
+	struct msghdr msg = {
+		.msg_iov = iov,
+		.msg_iovlen = payload ? 2 : 1,
+	};
+	ssize_t n;
+	do {
+		n = recvmsg(fd, &msg, 0);
+	} while (n < 0 && errno == EINTR);
+	if (n < 0) {
+		swaylock_log_errno(LOG_ERROR, "recvmsg() failed");
+		return -1;
+	} else if (n == 0) {
+		return 0;
 	}
-	return true;
+	if ((size_t)n < sizeof(*header) || (msg.msg_flags & MSG_TRUNC)) {
+		swaylock_log(LOG_ERROR, "recvmsg() failed: invalid message");
+		return -1;
+	}
+	return n;
 }
 
-ssize_t read_comm_request(char **buf_ptr) {
-	int fd = comm[0][0];
+ssize_t read_comm_request(uint32_t *id, char **buf_ptr) {
+	char *buf = password_buffer_create(COMM_PASSWORD_MAX);
+	if (!buf) {
+		return -1;
+	}
 
-	size_t size;
-	ssize_t n = read_full(fd, &size, sizeof(size));
+	struct comm_header header;
+	ssize_t n = read_message(comm[1], &header, buf, COMM_PASSWORD_MAX);
 	if (n <= 0) {
+		password_buffer_destroy(buf, COMM_PASSWORD_MAX);
 		return n;
 	}
-	assert(size > 0);
 
-	swaylock_log(LOG_DEBUG, "received pw check request");
-
-	char *buf = password_buffer_create(size);
-	if (!buf) {
-		return -1;
+	size_t size = n - sizeof(header);
+	if (header.type == COMM_MESSAGE_REQUEST && size == 0 && shared) {
+		// The password is in the shared region
+		password_buffer_destroy(buf, COMM_PASSWORD_MAX);
+		buf = shared;
+		size = header.value <= shared_size ? header.value : 0;
 	}
-
-	if (read_full(fd, buf, size) <= 0) {
-		swaylock_log_errno(LOG_ERROR, "failed to read pw");
+	if (header.type != COMM_MESSAGE_REQUEST || size == 0 ||
+			buf[size - 1] != '\0') {
+		swaylock_log(LOG_ERROR, "Received invalid pw check request");
+		release_comm_request(buf, COMM_PASSWORD_MAX);
 		return -1;
 	}
 
-	assert(buf[size - 1] == '\0');
+	swaylock_log(LOG_DEBUG, "received pw check request %u", header.id);
+	*id = header.id;
 	*buf_ptr = buf;
-	return size;
+	return buf == shared ? (ssize_t)size : COMM_PASSWORD_MAX;
 }
 
-bool write_comm_reply(bool success) {
-	return write_full(comm[1][1], &success, sizeof(success));
+void release_comm_request(char *buf, size_t size) {
+	if (buf == shared) {
+		clear_buffer(shared, shared_size);
+	} else {
+		password_buffer_destroy(buf, size);
+	}
 }
 
-bool spawn_comm_child(void) {
-	if (pipe(comm[0]) != 0) {
-		swaylock_log_errno(LOG_ERROR, "failed to create pipe");
-		return false;
+bool write_comm_reply(uint32_t id, enum comm_result result,
+		const struct comm_timing *timing) {
+	return write_message(comm[1], COMM_MESSAGE_RESULT, id, result,
+		timing, timing ? sizeof(*timing) : 0);
+}
+
+bool write_comm_status(uint32_t id, const char *message) {
+	size_t size = strnlen(message, COMM_MESSAGE_MAX - 1);
+	char buf[COMM_MESSAGE_MAX];
+	memcpy(buf, message, size);
+	buf[size] = '\0';
+	return write_message(comm[1], COMM_MESSAGE_STATUS, id, 0, buf, size + 1);
+}
+
+static void init_child(void) {
+	struct sigaction sa = {
+		.sa_handler = SIG_IGN,
+	};
+	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
+	trace_fork();
+	if (!password_buffer_init()) {
+		exit(EXIT_FAILURE);
+	}
+	// Nothing a child forks, such as PAM helpers, needs the password memory
+	password_buffer_exclude_from_children();
+}
+
+// Locking is not inherited by children, so this is done in each process which
+// uses the region, including swaylock itself again after daemonizing
+static void lock_shared_region(void) {
+	if (mlock(shared, shared_size) != 0) {
+		swaylock_log_errno(LOG_ERROR, "Unable to mlock() shared password memory");
+	}
+#if defined(MADV_DONTDUMP)
+	madvise(shared, shared_size, MADV_DONTDUMP);
+#elif defined(MADV_NOCORE)
+	madvise(shared, shared_size, MADV_NOCORE);
+#endif
+}
+
+static void map_shared_region(void) {
+#if HAVE_MEMFD_CREATE
+	int fd = memfd_create("swaylock", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (fd < 0) {
+		swaylock_log_errno(LOG_DEBUG, "memfd_create() failed, "
+			"passwords will be sent over the socket");
+		return;
+	}
+
+	long int page_size = sysconf(_SC_PAGESIZE);
+	size_t size = (COMM_PASSWORD_MAX + page_size - 1) / page_size * page_size;
+	if (ftruncate(fd, size) != 0 || fcntl(fd, F_ADD_SEALS,
+			F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL) != 0) {
+		swaylock_log_errno(LOG_ERROR, "Failed to set up memfd");
+		close(fd);
+		return;
+	}
+	char *region = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (region == MAP_FAILED) {
+		swaylock_log_errno(LOG_ERROR, "Failed to map memfd");
+		return;
 	}
-	if (pipe(comm[1]) != 0) {
-		swaylock_log_errno(LOG_ERROR, "failed to create pipe");
+
+	shared = region;
+	shared_size = size;
+	lock_shared_region();
+#endif
+}
+
+bool spawn_comm_child(void) {
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, comm) != 0) {
+		swaylock_log_errno(LOG_ERROR, "failed to create socket pair");
 		return false;
 	}
+	map_shared_region();
 	pid_t child = fork();
 	if (child < 0) {
 		swaylock_log_errno(LOG_ERROR, "failed to fork");
 		return false;
 	} else if (child == 0) {
-		struct sigaction sa = {
-			.sa_handler = SIG_IGN,
-		};
-		sigaction(SIGUSR1, &sa, NULL);
-		close(comm[0][1]);
-		close(comm[1][0]);
+		init_child();
+		if (shared) {
+			lock_shared_region();
+		}
+		close(comm[0]);
 		run_pw_backend_child();
 	}
-	close(comm[0][0]);
-	close(comm[1][1]);
+	close(comm[1]);
 	return true;
 }
 
-bool write_comm_request(struct swaylock_password *pw) {
-	bool result = false;
-	int fd = comm[0][1];
+void relock_comm_shared_region(void) {
+	if (shared) {
+		lock_shared_region();
+	}
+}
+
+struct comm_channel *spawn_comm_authenticator(const char *name,
+		void (*run)(void *data), void *data) {
+	if (authenticators_len == COMM_AUTHENTICATORS_MAX) {
+		swaylock_log(LOG_ERROR, "Too many authenticators, ignoring %s", name);
+		return NULL;
+	}
+
+	int fds[2];
+	if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) != 0) {
+		swaylock_log_errno(LOG_ERROR, "failed to create socket pair");
+		return NULL;
+	}
+	pid_t child = fork();
+	if (child < 0) {
+		swaylock_log_errno(LOG_ERROR, "failed to fork");
+		close(fds[0]);
+		close(fds[1]);
+		return NULL;
+	} else if (child == 0) {
+		init_child();
+		// Only talk to swaylock, over our own socket
+		close(comm[0]);
+		if (shared) {
+			munmap(shared, shared_size);
+			shared = NULL;
+		}
+		for (size_t i = 0; i < authenticators_len; ++i) {
+			if (authenticators[i].fd >= 0) {
+				close(authenticators[i].fd);
+			}
+		}
+		close(fds[0]);
+		comm[0] = -1;
+		comm[1] = fds[1];
+		run(data);
+		exit(EXIT_SUCCESS);
+	}
+	close(fds[1]);
+
+	struct comm_channel *channel = &authenticators[authenticators_len++];
+	*channel = (struct comm_channel){
+		.name = name,
+		.fd = fds[0],
+		.pid = child,
+	};
+	swaylock_log(LOG_DEBUG, "Spawned authenticator %s", name);
+	return channel;
+}
+
+void close_comm_authenticator(struct comm_channel *channel) {
+	if (channel->fd < 0) {
+		return;
+	}
+	close(channel->fd);
+	channel->fd = -1;
+	// Reap it if it already exited
+	waitpid(channel->pid, NULL, WNOHANG);
+}
+
+void cancel_comm_authenticators(void) {
+	for (size_t i = 0; i < authenticators_len; ++i) {
+		struct comm_channel *channel = &authenticators[i];
+		if (channel->fd < 0) {
+			continue;
+		}
+		// Children blocked in a PAM module cannot read the cancellation, so
+		// they are terminated as well
+		write_message(channel->fd, COMM_MESSAGE_CANCEL, 0, 0, NULL, 0);
+		kill(channel->pid, SIGTERM);
+		close_comm_authenticator(channel);
+	}
+}
+
+static pid_t helper_pid = -1;
+
+static void terminate_helper(int sig) {
+	if (helper_pid > 0) {
+		kill(-helper_pid, SIGTERM);
+	}
+	_exit(EXIT_FAILURE);
+}
+
+static void run_helper(void *data) {
+	const char *command = data;
+
+	int out[2];
+	if (pipe(out) != 0) {
+		swaylock_log_errno(LOG_ERROR, "Failed to create pipe for auth helper");
+		write_comm_reply(0, COMM_RESULT_FAILURE, NULL);
+		return;
+	}
+
+	// Do not leave the helper running when we are cancelled. SIGTERM is
+	// blocked until the process group which the handler terminates exists.
+	struct sigaction sa = {
+		.sa_handler = terminate_helper,
+	};
+	sigemptyset(&sa.sa_mask);
+	sigaction(SIGTERM, &sa, NULL);
+	sigset_t sigterm, old_mask;
+	sigemptyset(&sigterm);
+	sigaddset(&sigterm, SIGTERM);
+	sigprocmask(SIG_BLOCK, &sigterm, &old_mask);
+
+	helper_pid = fork();
+	if (helper_pid < 0) {
+		swaylock_log_errno(LOG_ERROR, "failed to fork");
+		sigprocmask(SIG_SETMASK, &old_mask, NULL);
+		write_comm_reply(0, COMM_RESULT_FAILURE, NULL);
+		return;
+	} else if (helper_pid == 0) {
+		// Its own process group, so that anything it spawns is terminated
+		// along with it
+		setpgid(0, 0);
+		sigprocmask(SIG_SETMASK, &old_mask, NULL);
+		// Ignored signals stay ignored across exec
+		sa.sa_handler = SIG_DFL;
+		sigaction(SIGUSR1, &sa, NULL);
+		sigaction(SIGUSR2, &sa, NULL);
+		int null = open("/dev/null", O_RDONLY);
+		if (null >= 0) {
+			dup2(null, STDIN_FILENO);
+			close(null);
+		}
+		dup2(out[1], STDOUT_FILENO);
+		close(out[0]);
+		close(out[1]);
+		execl("/bin/sh", "sh", "-c", command, (char *)NULL);
+		_exit(127);
+	}
+	// Also done here, as the helper may not have run yet. This fails once it
+	// called exec(), but then it already is in its own group.
+	setpgid(helper_pid, helper_pid);
+	sigprocmask(SIG_SETMASK, &old_mask, NULL);
+	close(out[1]);
+
+	// Forward each line the helper prints as a status message, until it
+	// closes its output or swaylock cancels it
+	char line[COMM_MESSAGE_MAX];
+	size_t len = 0;
+	struct pollfd fds[2] = {
+		{ .fd = comm[1], .events = POLLIN },
+		{ .fd = out[0], .events = POLLIN },
+	};
+	while (fds[1].fd >= 0) {
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			swaylock_log_errno(LOG_ERROR, "poll() failed");
+			break;
+		}
+		if (fds[0].revents) {
+			// Cancelled, or swaylock exited
+			kill(-helper_pid, SIGTERM);
+			waitpid(helper_pid, NULL, 0);
+			return;
+		}
+		if (!fds[1].revents) {
+			continue;
+		}
+
+		ssize_t n = read(out[0], &line[len], sizeof(line) - 1 - len);
+		if (n < 0 && errno == EINTR) {
+			continue;
+		} else if (n <= 0) {
+			close(out[0]);
+			fds[1].fd = -1;
+			n = 0;
+		}
+		len += n;
+
+		char *start = line, *end;
+		while ((end = memchr(start, '\n', len - (start - line)))) {
+			*end = '\0';
+			write_comm_status(0, start);
+			start = end + 1;
+		}
+		len -= start - line;
+		memmove(line, start, len);
+		if (len > 0 && (len == sizeof(line) - 1 || fds[1].fd < 0)) {
+			line[len] = '\0';
+			write_comm_status(0, line);
+			len = 0;
+		}
+	}
+
+	int status = 0;
+	while (waitpid(helper_pid, &status, 0) < 0) {
+		if (errno != EINTR) {
+			swaylock_log_errno(LOG_ERROR, "waitpid() failed");
+			status = -1;
+			break;
+		}
+	}
+	bool success = status >= 0 && WIFEXITED(status) &&
+		WEXITSTATUS(status) == 0;
+	swaylock_log(LOG_DEBUG, "Auth helper %s", success ? "succeeded" : "failed");
+	write_comm_reply(0, success ? COMM_RESULT_SUCCESS : COMM_RESULT_FAILURE,
+		NULL);
+}
+
+struct comm_channel *spawn_comm_helper(const char *command) {
+	return spawn_comm_authenticator(command, run_helper, (void *)command);
+}
+
+uint32_t write_comm_request(struct swaylock_password *pw) {
+	static uint32_t next_id = 1;
+	uint32_t id = 0;
+	SWAYLOCK_PROBE(comm_request);
+	trace_begin("comm_request");
 
 	size_t size = pw->len + 1;
-	if (!write_full(fd, &size, sizeof(size))) {
-		swaylock_log_errno(LOG_ERROR, "Failed to write pw size");
+	if (size > COMM_PASSWORD_MAX) {
+		swaylock_log(LOG_ERROR, "Password too long");
 		goto out;
 	}
-
-	if (!write_full(fd, pw->buffer, size)) {
-		swaylock_log_errno(LOG_ERROR, "Failed to write pw buffer");
+	if (shared && !shared_request) {
+		memcpy(shared, pw->buffer, size);
+		if (!write_message(comm[0], COMM_MESSAGE_REQUEST, next_id, size,
+				NULL, 0)) {
+			swaylock_log(LOG_ERROR, "Failed to write pw check request");
+			clear_buffer(shared, size);
+			goto out;
+		}
+		shared_request = next_id;
+	} else if (!write_message(comm[0], COMM_MESSAGE_REQUEST, next_id, 0,
+			pw->buffer, size)) {
+		swaylock_log(LOG_ERROR, "Failed to write pw check request");
 		goto out;
 	}
 
-	result = true;
+	id = next_id++;
+	if (next_id == 0) {
+		next_id = 1;
+	}
 
 out:
 	clear_password_buffer(pw);
-	return result;
+	trace_end("comm_request");
+	return id;
 }
 
-bool read_comm_reply(bool *auth_success) {
-	if (read_full(comm[1][0], auth_success, sizeof(*auth_success)) <= 0) {
-		swaylock_log(LOG_ERROR, "Failed to read pw result");
-		return false;
+bool read_comm_reply(int fd, struct comm_reply *reply) {
+	trace_begin("comm_reply");
+	struct comm_header header;
+	ssize_t n = read_message(fd, &header, reply->message,
+		sizeof(reply->message));
+	bool result = false;
+	if (n <= 0) {
+		goto out;
 	}
-	return true;
+
+	size_t size = n - sizeof(header);
+	reply->id = header.id;
+	switch (header.type) {
+	case COMM_MESSAGE_STATUS:
+		reply->final = false;
+		reply->message[size > 0 ? size - 1 : 0] = '\0';
+		break;
+	case COMM_MESSAGE_RESULT:
+		reply->final = true;
+		reply->result = header.value;
+		reply->timing = (struct comm_timing){0};
+		if (size == sizeof(reply->timing)) {
+			memcpy(&reply->timing, reply->message, size);
+		}
+		reply->message[0] = '\0';
+		if (shared_request && header.id == shared_request) {
+			clear_buffer(shared, shared_size);
+			shared_request = 0;
+		}
+		SWAYLOCK_PROBE(comm_reply, reply->result == COMM_RESULT_SUCCESS);
+		break;
+	default:
+		swaylock_log(LOG_ERROR, "Unexpected message from child");
+		goto out;
+	}
+	result = true;
+
+out:
+	trace_end("comm_reply");
+	return result;
 }
 
 int get_comm_reply_fd(void) {
-	return comm[1][0];
+	return comm[0];
+}
+
+uint64_t get_comm_time(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
 }
@@ -1,5 +1,7 @@
 # swaylock(1) completion
 
+complete -c swaylock -l auth-helper                 --description "Also unlock when the given command exits successfully."
+complete -c swaylock -l backoff                     --description "Delay after a wrong password: none, fixed, exponential."
 complete -c swaylock -l bs-hl-color                 --description "Sets the color of backspace highlight segments."
 complete -c swaylock -l caps-lock-bs-hl-color       --description "Sets the color of backspace highlight segments when Caps Lock is active."
 complete -c swaylock -l caps-lock-key-hl-color      --description "Sets the color of the key press highlight segments when Caps Lock is active."
@@ -14,8 +16,10 @@ complete -c swaylock -l help                   -s h --description "Show help mes
 complete -c swaylock -l hide-keyboard-layout   -s K --description "Hide the current xkb layout while typing."
 complete -c swaylock -l ignore-empty-password  -s e --description "When an empty password is provided, do not validate it."
 complete -c swaylock -l image                  -s i --description "Display the given image, optionally only on the given output."
+complete -c swaylock -l immediate-pam-service      --description "Also authenticate with the given PAM service as soon as the screen is locked."
 complete -c swaylock -l indicator-caps-lock    -s l --description "Show the current Caps Lock state also on the indicator."
 complete -c swaylock -l indicator-idle-visible      --description "Sets the indicator to show even if idle."
+complete -c swaylock -l indicator-output            --description "Shows the indicator only on the named, focused or primary output."
 complete -c swaylock -l indicator-radius            --description "Sets the indicator radius."
 complete -c swaylock -l indicator-thickness         --description "Sets the indicator thickness."
 complete -c swaylock -l indicator-x-position        --description "Sets the horizontal position of the indicator."
@@ -36,6 +40,7 @@ complete -c swaylock -l line-uses-inside       -s n --description "Use the insid
 complete -c swaylock -l line-uses-ring         -s r --description "Use the ring color for the line between the inside and ring."
 complete -c swaylock -l line-ver-color              --description "Sets the color of the line between the inside and ring when verifying."
 complete -c swaylock -l line-wrong-color            --description "Sets the color of the line between the inside and ring when invalid."
+complete -c swaylock -l low-memory                  --description "Use 16 bits per pixel for opaque backgrounds, if supported."
 complete -c swaylock -l no-unlock-indicator    -s u --description "Disable the unlock indicator."
 complete -c swaylock -l ring-caps-lock-color        --description "Sets the color of the ring of the indicator when Caps Lock is active."
 complete -c swaylock -l ring-clear-color            --description "Sets the color of the ring of the indicator when cleared."
@@ -0,0 +1,41 @@
+#include "swaylock.h"
+
+void set_default_colors(struct swaylock_colors *colors) {
+	colors->background = 0xA3A3A3FF;
+	colors->bs_highlight = 0xDB3300FF;
+	colors->key_highlight = 0x33DB00FF;
+	colors->caps_lock_bs_highlight = 0xDB3300FF;
+	colors->caps_lock_key_highlight = 0x33DB00FF;
+	colors->separator = 0x000000FF;
+	colors->layout_background = 0x000000C0;
+	colors->layout_border = 0x00000000;
+	colors->layout_text = 0xFFFFFFFF;
+	colors->inside = (struct swaylock_colorset){
+		.input = 0x000000C0,
+		.cleared = 0xE5A445C0,
+		.caps_lock = 0x000000C0,
+		.verifying = 0x0072FFC0,
+		.wrong = 0xFA0000C0,
+	};
+	colors->line = (struct swaylock_colorset){
+		.input = 0x000000FF,
+		.cleared = 0x000000FF,
+		.caps_lock = 0x000000FF,
+		.verifying = 0x000000FF,
+		.wrong = 0x000000FF,
+	};
+	colors->ring = (struct swaylock_colorset){
+		.input = 0x337D00FF,
+		.cleared = 0xE5A445FF,
+		.caps_lock = 0xE5A445FF,
+		.verifying = 0x3300FFFF,
+		.wrong = 0x7D3300FF,
+	};
+	colors->text = (struct swaylock_colorset){
+		.input = 0xE5A445FF,
+		.cleared = 0x000000FF,
+		.caps_lock = 0xE5A445FF,
+		.verifying = 0x000000FF,
+		.wrong = 0x000000FF,
+	};
+}
@@ -0,0 +1,20 @@
+#ifndef _SWAYLOCK_AUTH_STATS_H
+#define _SWAYLOCK_AUTH_STATS_H
+#include <stdbool.h>
+#include <stdint.h>
+
+struct comm_timing;
+
+/**
+ * Records a password check which took total microseconds from its submission
+ * to its result, along with the breakdown reported by the child.
+ */
+void auth_stats_record(bool success, uint64_t total,
+	const struct comm_timing *timing);
+
+/**
+ * Logs latency histograms of all password checks so far.
+ */
+void auth_stats_log(void);
+
+#endif
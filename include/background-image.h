@@ -1,5 +1,6 @@
 #ifndef _SWAY_BACKGROUND_IMAGE_H
 #define _SWAY_BACKGROUND_IMAGE_H
+#include <stdbool.h>
 #include "cairo.h"
 
 enum background_mode {
@@ -16,5 +17,18 @@ enum background_mode parse_background_mode(const char *mode);
 cairo_surface_t *load_background_image(const char *path);
 void render_background_image(cairo_t *cairo, cairo_surface_t *image,
 		enum background_mode mode, int buffer_width, int buffer_height);
+// Draws the image as render_background_image() does, but only with cairo's
+// filters, which the faster paths for some sizes are measured against
+void render_background_image_cairo(cairo_t *cairo, cairo_surface_t *image,
+		enum background_mode mode, int buffer_width, int buffer_height);
+// Frees the downscaled copies of the image built when rendering it at less than
+// half its size. They are built again if needed.
+void release_background_image_levels(cairo_surface_t *image);
+// Computes the area covered by the image in the fit and center modes, rounded
+// outwards to whole pixels and clipped to the buffer. Returns whether the image
+// covers whole pixels, in which case no rounding was needed.
+bool get_background_image_box(cairo_surface_t *image, enum background_mode mode,
+		int buffer_width, int buffer_height,
+		int *x, int *y, int *width, int *height);
 
 #endif
@@ -2,17 +2,81 @@
 #define _SWAYLOCK_COMM_H
 
 #include <stdbool.h>
+#include <stdint.h>
+#include <sys/types.h>
+
+// Largest password, including its NUL terminator, that can be checked
+#define COMM_PASSWORD_MAX 1024
+// Largest status message, including its NUL terminator
+#define COMM_MESSAGE_MAX 512
 
 struct swaylock_password;
 
+enum comm_result {
+	COMM_RESULT_FAILURE,
+	COMM_RESULT_SUCCESS,
+};
+
+// Time spent by the child on a request, in microseconds
+struct comm_timing {
+	uint64_t auth; // checking the credentials
+	uint64_t delay; // waiting after a failure, as requested by PAM modules
+};
+
+// A message from the password checking child about a request
+struct comm_reply {
+	uint32_t id;
+	// Whether this is the result of the request, as opposed to a status
+	// message sent while it is being processed
+	bool final;
+	enum comm_result result;
+	struct comm_timing timing; // zero unless reported along with the result
+	char message[COMM_MESSAGE_MAX];
+};
+
+// A child authenticating the user by other means than the typed password,
+// concurrently with the password checking child
+struct comm_channel {
+	const char *name;
+	int fd; // swaylock's end of the socket, or -1 once closed
+	pid_t pid;
+};
+
 bool spawn_comm_child(void);
-ssize_t read_comm_request(char **buf_ptr);
-bool write_comm_reply(bool success);
+// Locks the memory shared with the password checking child again in a child of
+// swaylock which takes its place, such as when daemonizing.
+void relock_comm_shared_region(void);
+
+// Spawns a child running run(data), which starts authenticating immediately
+// and reports with write_comm_status() and write_comm_reply() using the ID 0.
+struct comm_channel *spawn_comm_authenticator(const char *name,
+	void (*run)(void *data), void *data);
+// Spawns an authenticator running the shell command, which succeeds when the
+// command exits with status 0. Each line it prints is sent as a status message.
+struct comm_channel *spawn_comm_helper(const char *command);
+void close_comm_authenticator(struct comm_channel *channel);
+// Stops and closes all authenticators which are still running.
+void cancel_comm_authenticators(void);
+
+// Reads the next password check request, and returns the size of the buffer
+// it was stored in, or 0 once swaylock has exited. The buffer must be released
+// with release_comm_request().
+ssize_t read_comm_request(uint32_t *id, char **buf_ptr);
+void release_comm_request(char *buf, size_t size);
+bool write_comm_reply(uint32_t id, enum comm_result result,
+	const struct comm_timing *timing);
+bool write_comm_status(uint32_t id, const char *message);
+
 // Requests the provided password to be checked. The password is always cleared
-// when the function returns.
-bool write_comm_request(struct swaylock_password *pw);
-bool read_comm_reply(bool *auth_success);
+// when the function returns. Returns the ID of the request, or 0 on failure.
+uint32_t write_comm_request(struct swaylock_password *pw);
+// Reads a message from the password checking child or an authenticator.
+// Returns false if the child exited or sent an invalid message.
+bool read_comm_reply(int fd, struct comm_reply *reply);
 // FD to poll for password authentication replies.
 int get_comm_reply_fd(void);
 
+// Monotonic time in microseconds, for measuring struct comm_timing
+uint64_t get_comm_time(void);
+
 #endif
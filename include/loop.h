@@ -1,6 +1,7 @@
 #ifndef _SWAY_LOOP_H
 #define _SWAY_LOOP_H
 #include <stdbool.h>
+#include <time.h>
 
 /**
  * This is an event loop system designed for sway clients, not sway itself.
@@ -41,6 +42,20 @@ void loop_add_fd(struct loop *loop, int fd, short mask,
 struct loop_timer *loop_add_timer(struct loop *loop, int ms,
 		void (*callback)(void *data), void *data);
 
+/**
+ * Replace the clock which timers are measured against, CLOCK_MONOTONIC by
+ * default. Used to run the timers on a virtual clock in tests.
+ */
+void loop_set_clock(struct loop *loop,
+		void (*get_time)(struct timespec *now, void *data), void *data);
+
+/**
+ * Get the expiry of the timer which expires first, on the loop's clock.
+ *
+ * Returns false if there are no timers.
+ */
+bool loop_next_timer(struct loop *loop, struct timespec *expiry);
+
 /**
  * Remove a file descriptor from the loop.
  */
@@ -1,9 +1,22 @@
 #ifndef _SWAY_PASSWORD_BUFFER_H
 #define _SWAY_PASSWORD_BUFFER_H
 
+#include <stdbool.h>
 #include <stddef.h>
 
+// Sets up the memory secrets are allocated from. Must be called in each
+// process before allocating any buffer, including in forked children.
+bool password_buffer_init(void);
 char *password_buffer_create(size_t size);
+// Moves the contents of the buffer to a new one of the given size, and
+// releases it. Returns NULL, leaving the buffer untouched, on failure.
+char *password_buffer_resize(char *buffer, size_t size, size_t new_size);
 void password_buffer_destroy(char *buffer, size_t size);
+// Locks the arena again in the child of a fork() which keeps using it in place
+// of its parent, such as when daemonizing, as locks are not inherited.
+bool password_buffer_relock(void);
+// Leaves the arena out of the children forked from then on, which set up their
+// own. Must not be called before a fork() whose child keeps using the arena.
+void password_buffer_exclude_from_children(void);
 
 #endif
@@ -15,8 +15,17 @@ struct pool_buffer {
 	bool busy;
 };
 
+// Records the pixel formats supported by the compositor. Must be called before
+// the first roundtrip after binding wl_shm.
+void listen_shm_formats(struct wl_shm *shm);
+bool shm_format_supported(uint32_t format);
+
 struct pool_buffer *create_buffer(struct wl_shm *shm, struct pool_buffer *buf,
 	int32_t width, int32_t height, uint32_t format);
+// Prepares a buffer which is not busy for drawing at the given size, keeping its
+// memory and contents if it already has that size
+struct pool_buffer *reuse_buffer(struct wl_shm *shm, struct pool_buffer *buffer,
+	uint32_t width, uint32_t height);
 struct pool_buffer *get_next_buffer(struct wl_shm *shm,
 	struct pool_buffer pool[static 2], uint32_t width, uint32_t height);
 void destroy_buffer(struct pool_buffer *buffer);
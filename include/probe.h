@@ -0,0 +1,23 @@
+#ifndef _SWAYLOCK_PROBE_H
+#define _SWAYLOCK_PROBE_H
+#include "config.h"
+
+/**
+ * USDT static tracepoints, for use with bpftrace, perf or SystemTap, e.g.:
+ *
+ *   bpftrace -e 'usdt:/usr/bin/swaylock:swaylock:render_end { ... }'
+ *
+ * When swaylock is built without the sdt option, probes compile to nothing
+ * and their arguments are not evaluated.
+ *
+ * Probes must never be given password contents, lengths or key symbols.
+ */
+
+#if HAVE_SDT
+#include <sys/sdt.h>
+#define SWAYLOCK_PROBE(name, ...) STAP_PROBEV(swaylock, name, ##__VA_ARGS__)
+#else
+#define SWAYLOCK_PROBE(name, ...)
+#endif
+
+#endif
@@ -7,22 +7,38 @@
 struct loop;
 struct loop_timer;
 
+#define KEYMAP_CACHE_SIZE 4
+
+// A compiled keymap, identified by the keymap text it was compiled from
+struct swaylock_keymap_cache_entry {
+	uint64_t hash;
+	uint32_t size;
+	char *text; // copy of the text it was compiled from
+	uint64_t last_used;
+	struct xkb_keymap *keymap;
+};
+
 struct swaylock_xkb {
 	bool caps_lock;
 	bool control;
 	struct xkb_state *state;
 	struct xkb_context *context;
 	struct xkb_keymap *keymap;
+	// Recently compiled keymaps, which compositors often send again, e.g. for
+	// each seat or when switching back to a keyboard
+	struct swaylock_keymap_cache_entry keymap_cache[KEYMAP_CACHE_SIZE];
+	uint64_t keymap_cache_clock;
 };
 
 struct swaylock_seat {
 	struct swaylock_state *state;
 	struct wl_pointer *pointer;
 	struct wl_keyboard *keyboard;
-	int32_t repeat_period_ms;
+	int64_t repeat_period_ns; // -1 if keys do not repeat
 	int32_t repeat_delay_ms;
 	uint32_t repeat_sym;
 	uint32_t repeat_codepoint;
+	uint64_t repeat_deadline; // of the next repeat, CLOCK_MONOTONIC in ns
 	struct loop_timer *repeat_timer;
 };
 
@@ -24,6 +24,14 @@ enum input_state {
 	INPUT_STATE_NEUTRAL, // pressed a key (like Ctrl) that did nothing
 };
 
+// Delay imposed after a wrong password before another one can be checked
+enum backoff_mode {
+	BACKOFF_MODE_NONE,
+	BACKOFF_MODE_FIXED, // 2 seconds
+	BACKOFF_MODE_EXPONENTIAL, // doubling with each failure, up to a minute
+	BACKOFF_MODE_INVALID,
+};
+
 struct swaylock_colorset {
 	uint32_t input;
 	uint32_t cleared;
@@ -60,6 +68,7 @@ struct swaylock_args {
 	bool override_indicator_x_position;
 	bool override_indicator_y_position;
 	bool ignore_empty;
+	enum backoff_mode backoff;
 	bool show_indicator;
 	bool show_caps_lock_text;
 	bool show_caps_lock_indicator;
@@ -69,6 +78,12 @@ struct swaylock_args {
 	bool daemonize;
 	int ready_fd;
 	bool indicator_idle_visible;
+	bool low_memory;
+	// Name of the only output showing the indicator, "focused" or "primary",
+	// or NULL for all outputs
+	char *indicator_output;
+	char *immediate_pam_service;
+	char *auth_helper;
 };
 
 struct swaylock_password {
@@ -82,46 +97,112 @@ struct swaylock_state {
 	struct loop_timer *input_idle_timer; // timer to reset input state to IDLE
 	struct loop_timer *auth_idle_timer; // timer to stop displaying AUTH_STATE_INVALID
 	struct loop_timer *clear_password_timer;  // clears the password buffer
+	struct loop_timer *backoff_timer; // counts down backoff_remaining
 	struct wl_display *display;
 	struct wl_compositor *compositor;
 	struct wl_subcompositor *subcompositor;
+	struct wp_viewporter *viewporter; // optional
 	struct wl_shm *shm;
 	struct wl_list surfaces;
+	// Surface which the keyboard or pointer entered last, if any
+	struct swaylock_surface *focused_surface;
 	struct wl_list images;
 	struct swaylock_args args;
 	struct swaylock_password password;
+	// Password submitted while another one was being verified
+	struct swaylock_password queued_password;
+	bool password_queued;
 	struct swaylock_xkb xkb;
 	cairo_surface_t *test_surface;
 	cairo_t *test_cairo; // used to estimate font/text sizes
 	enum auth_state auth_state; // state of the authentication attempt
 	enum input_state input_state; // state of the password buffer and key inputs
 	uint32_t highlight_start; // position of highlight; 2048 = 1 full turn
+	uint32_t next_highlight_start; // chosen in advance, to draw it ahead of time
+	uint32_t auth_request; // ID of the password check request in progress
+	uint64_t auth_start; // when it was submitted, from get_comm_time()
 	int failed_attempts;
+	int backoff_remaining; // seconds until another password can be submitted
 	bool run_display, locked;
 	struct ext_session_lock_manager_v1 *ext_session_lock_manager_v1;
 	struct ext_session_lock_v1 *ext_session_lock_v1;
 };
 
+// The indicator is split into layers, each drawn into its own subsurface, so
+// that a keystroke only redraws the highlight. They are stacked in this order.
+// The ring layer is a subsurface of the background surface, and the others are
+// synchronized subsurfaces of the ring layer, which are all updated by a single
+// commit of the ring layer.
+enum indicator_layer {
+	INDICATOR_LAYER_RING, // inner fill, ring and its borders
+	INDICATOR_LAYER_TEXT, // message and keyboard layout
+	INDICATOR_LAYER_HIGHLIGHT, // typing indicator
+	INDICATOR_LAYER_COUNT,
+};
+
+// What the indicator shows, to tell which layers must be redrawn
+struct swaylock_indicator_content {
+	bool visible;
+	int width, height; // of the whole indicator, in buffer pixels
+	int32_t scale;
+	uint32_t inside, ring, line, text_color;
+	char *text, *layout_text;
+	bool highlight;
+	uint32_t highlight_color, highlight_start;
+};
+
+// Besides the buffer being shown, the buffers of a layer keep frames drawn ahead
+// of time for the likely next inputs, and frames which may be shown again
+#define INDICATOR_LAYER_BUFFERS 4
+
+struct swaylock_indicator_layer {
+	struct wl_surface *surface;
+	struct wl_subsurface *subsurface;
+	struct pool_buffer buffers[INDICATOR_LAYER_BUFFERS];
+	// What each buffer holds, if it has been drawn into
+	struct swaylock_indicator_content drawn[INDICATOR_LAYER_BUFFERS];
+	uint64_t last_used[INDICATOR_LAYER_BUFFERS];
+	struct pool_buffer *shown; // buffer committed last
+	int32_t x, y; // position relative to the ring layer
+};
+
 struct swaylock_surface {
 	cairo_surface_t *image;
 	struct swaylock_state *state;
 	struct wl_output *output;
 	uint32_t output_global_name;
 	struct wl_surface *surface; // surface for background
-	struct wl_surface *child; // indicator surface made into subsurface
-	struct wl_subsurface *subsurface;
+	// Scales a single pixel buffer to the whole surface, when the background
+	// surface only shows the background color
+	struct wp_viewport *viewport;
+	// Image drawn in fit and center modes, so that the background surface
+	// only needs to show the background color
+	struct wl_surface *image_surface;
+	struct wl_subsurface *image_subsurface;
+	struct swaylock_indicator_layer layers[INDICATOR_LAYER_COUNT];
+	struct loop_timer *prerender_timer;
 	struct ext_session_lock_surface_v1 *ext_session_lock_surface_v1;
-	struct pool_buffer indicator_buffers[2];
 	bool created;
 	bool dirty;
 	uint32_t width, height;
 	int32_t scale;
+	int32_t refresh; // of the current mode, in mHz, or 0 if unknown
 	enum wl_output_subpixel subpixel;
+	// Output properties received since the last wl_output.done event, which
+	// are applied together
+	int32_t pending_scale, pending_refresh;
+	enum wl_output_subpixel pending_subpixel;
 	char *output_name;
 	struct wl_list link;
 	struct wl_callback *frame;
+	// Frame callback of the ring layer, once it is desynchronized
+	struct wl_callback *child_frame;
+	// Whether commits of the ring layer only take effect with the background's
+	bool child_sync;
+	int32_t child_x, child_y; // last position requested for the indicator
 	// Dimensions of last wl_buffer committed to background surface
 	int last_buffer_width, last_buffer_height;
+	int32_t last_buffer_scale;
 };
 
 // There is exactly one swaylock_image for each -i argument
@@ -136,12 +217,35 @@ void swaylock_handle_key(struct swaylock_state *state,
 		xkb_keysym_t keysym, uint32_t codepoint);
 
 void render(struct swaylock_surface *surface);
+// Draws the background of a buffer of the given size, as render() does, into
+// any cairo context
+void render_background(cairo_t *cairo, struct swaylock_state *state,
+		cairo_surface_t *image, int buffer_width, int buffer_height);
+// Draws the indicator layers for the current state, as render() does into its
+// buffers, into image surfaces which are replaced if they do not have the
+// right size. Used to measure rendering without a compositor.
+void render_indicator_layers(struct swaylock_surface *surface,
+		cairo_surface_t *layers[static INDICATOR_LAYER_COUNT]);
 void damage_state(struct swaylock_state *state);
+bool surface_shows_indicator(struct swaylock_surface *surface);
+// Whether the background covers the whole surface with opaque pixels
+bool surface_is_opaque(struct swaylock_surface *surface);
+// Tracks the output with keyboard or pointer focus, from an enter event
+void focus_surface(struct swaylock_state *state, struct wl_surface *wl_surface);
 void clear_password_buffer(struct swaylock_password *pw);
 void schedule_auth_idle(struct swaylock_state *state);
+void clear_queued_password(struct swaylock_state *state);
+// Handles the failure of the password check request in progress
+void handle_auth_failure(struct swaylock_state *state);
+enum backoff_mode parse_backoff_mode(const char *mode);
+// Sets the colors swaylock uses when none are configured
+void set_default_colors(struct swaylock_colors *colors);
 
 void initialize_pw_backend(int argc, char **argv);
 void run_pw_backend_child(void);
+// Spawns an authenticator for a PAM service which needs no password, such as a
+// fingerprint reader. Returns NULL if it cannot be used.
+struct comm_channel *spawn_immediate_pam_child(const char *service);
 void clear_buffer(char *buf, size_t size);
 
 #endif
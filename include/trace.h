@@ -0,0 +1,43 @@
+#ifndef _SWAYLOCK_TRACE_H
+#define _SWAYLOCK_TRACE_H
+#include <stdbool.h>
+
+/**
+ * In-memory tracing of begin/end spans, exported as Chrome trace-event JSON.
+ *
+ * Tracing is enabled by setting SWAYLOCK_TRACE to the path of the output
+ * file. Events are recorded into a fixed-size ring buffer without allocating
+ * or doing any I/O, and are only formatted when the ring is dumped: on exit,
+ * or when requested with SIGUSR2. Each process (swaylock itself and the
+ * password checking child) keeps its own ring and appends to the same file.
+ *
+ * Event names must be string literals; only the pointer is recorded.
+ */
+
+/**
+ * Enable tracing if requested by the environment. Must be called before any
+ * child process is forked.
+ */
+void trace_init(void);
+
+/**
+ * Whether tracing has been enabled by trace_init().
+ */
+bool trace_enabled(void);
+
+/**
+ * Take ownership of the trace in a newly forked process. Events inherited
+ * from the parent are dropped; they are dumped by the parent.
+ */
+void trace_fork(void);
+
+void trace_begin(const char *name);
+void trace_end(const char *name);
+void trace_instant(const char *name);
+
+/**
+ * Append all events recorded since the last dump to the trace file.
+ */
+void trace_dump(void);
+
+#endif
@@ -9,10 +9,13 @@
 #include <wayland-client.h>
 #include "log.h"
 #include "loop.h"
+#include "probe.h"
+#include "trace.h"
 
 struct loop_fd_event {
 	void (*callback)(int fd, short mask, void *data);
 	void *data;
+	bool removed;
 	struct wl_list link; // struct loop_fd_event::link
 };
 
@@ -31,8 +34,20 @@ struct loop {
 
 	struct wl_list fd_events; // struct loop_fd_event::link
 	struct wl_list timers; // struct loop_timer::link
+
+	// NULL for CLOCK_MONOTONIC
+	void (*get_time)(struct timespec *now, void *data);
+	void *clock_data;
 };
 
+static void get_loop_time(struct loop *loop, struct timespec *now) {
+	if (loop->get_time) {
+		loop->get_time(now, loop->clock_data);
+	} else {
+		clock_gettime(CLOCK_MONOTONIC, now);
+	}
+}
+
 struct loop *loop_create(void) {
 	struct loop *loop = calloc(1, sizeof(struct loop));
 	if (!loop) {
@@ -66,11 +81,15 @@ void loop_poll(struct loop *loop) {
 	int ms = INT_MAX;
 	if (!wl_list_empty(&loop->timers)) {
 		struct timespec now;
-		clock_gettime(CLOCK_MONOTONIC, &now);
+		get_loop_time(loop, &now);
 		struct loop_timer *timer = NULL;
 		wl_list_for_each(timer, &loop->timers, link) {
-			int timer_ms = (timer->expiry.tv_sec - now.tv_sec) * 1000;
-			timer_ms += (timer->expiry.tv_nsec - now.tv_nsec) / 1000000;
+			// Round up, so that poll() does not wake up (and spin) just before
+			// the timer actually expires
+			long long timer_ns =
+				(long long)(timer->expiry.tv_sec - now.tv_sec) * 1000000000 +
+				(timer->expiry.tv_nsec - now.tv_nsec);
+			int timer_ms = timer_ns > 0 ? (timer_ns + 999999) / 1000000 : 0;
 			if (timer_ms < ms) {
 				ms = timer_ms;
 			}
@@ -85,27 +104,43 @@ void loop_poll(struct loop *loop) {
 		swaylock_log_errno(LOG_ERROR, "poll failed");
 		exit(1);
 	}
+	SWAYLOCK_PROBE(loop_wake, ret);
 
 	// Dispatch fds
 	size_t fd_index = 0;
-	struct loop_fd_event *event = NULL;
+	struct loop_fd_event *event = NULL, *tmp_event = NULL;
 	wl_list_for_each(event, &loop->fd_events, link) {
 		struct pollfd pfd = loop->fds[fd_index];
 
 		// Always send these events
 		unsigned events = pfd.events | POLLHUP | POLLERR;
 
-		if (pfd.revents & events) {
+		if (!event->removed && (pfd.revents & events)) {
 			event->callback(pfd.fd, pfd.revents, event->data);
 		}
 
 		++fd_index;
 	}
 
+	// Clean up fds removed from the loop
+	fd_index = 0;
+	wl_list_for_each_safe(event, tmp_event, &loop->fd_events, link) {
+		if (!event->removed) {
+			++fd_index;
+			continue;
+		}
+		wl_list_remove(&event->link);
+		free(event);
+
+		loop->fd_length--;
+		memmove(&loop->fds[fd_index], &loop->fds[fd_index + 1],
+				sizeof(struct pollfd) * (loop->fd_length - fd_index));
+	}
+
 	// Dispatch timers
 	if (!wl_list_empty(&loop->timers)) {
 		struct timespec now;
-		clock_gettime(CLOCK_MONOTONIC, &now);
+		get_loop_time(loop, &now);
 		struct loop_timer *timer = NULL, *tmp_timer = NULL;
 		wl_list_for_each_safe(timer, tmp_timer, &loop->timers, link) {
 			if (timer->removed) {
@@ -118,7 +153,10 @@ void loop_poll(struct loop *loop) {
 				(timer->expiry.tv_sec == now.tv_sec &&
 				 timer->expiry.tv_nsec < now.tv_nsec);
 			if (expired) {
+				SWAYLOCK_PROBE(timer_dispatch);
+				trace_begin("timer");
 				timer->callback(timer->data);
+				trace_end("timer");
 				wl_list_remove(&timer->link);
 				free(timer);
 			}
@@ -158,7 +196,7 @@ struct loop_timer *loop_add_timer(struct loop *loop, int ms,
 	timer->callback = callback;
 	timer->data = data;
 
-	clock_gettime(CLOCK_MONOTONIC, &timer->expiry);
+	get_loop_time(loop, &timer->expiry);
 	timer->expiry.tv_sec += ms / 1000;
 
 	long int nsec = (ms % 1000) * 1000000;
@@ -173,17 +211,38 @@ struct loop_timer *loop_add_timer(struct loop *loop, int ms,
 	return timer;
 }
 
+void loop_set_clock(struct loop *loop,
+		void (*get_time)(struct timespec *now, void *data), void *data) {
+	loop->get_time = get_time;
+	loop->clock_data = data;
+}
+
+bool loop_next_timer(struct loop *loop, struct timespec *expiry) {
+	bool found = false;
+	struct loop_timer *timer = NULL;
+	wl_list_for_each(timer, &loop->timers, link) {
+		if (timer->removed) {
+			continue;
+		}
+		if (!found || timer->expiry.tv_sec < expiry->tv_sec ||
+				(timer->expiry.tv_sec == expiry->tv_sec &&
+				 timer->expiry.tv_nsec < expiry->tv_nsec)) {
+			*expiry = timer->expiry;
+			found = true;
+		}
+	}
+	return found;
+}
+
 bool loop_remove_fd(struct loop *loop, int fd) {
 	size_t fd_index = 0;
-	struct loop_fd_event *event = NULL, *tmp_event = NULL;
-	wl_list_for_each_safe(event, tmp_event, &loop->fd_events, link) {
-		if (loop->fds[fd_index].fd == fd) {
-			wl_list_remove(&event->link);
-			free(event);
-
-			loop->fd_length--;
-			memmove(&loop->fds[fd_index], &loop->fds[fd_index + 1],
-					sizeof(struct pollfd) * (loop->fd_length - fd_index));
+	struct loop_fd_event *event = NULL;
+	wl_list_for_each(event, &loop->fd_events, link) {
+		if (!event->removed && loop->fds[fd_index].fd == fd) {
+			// Freed after the next dispatch, as this may be called from a
+			// callback. poll() ignores negative fds until then.
+			event->removed = true;
+			loop->fds[fd_index].fd = -1;
 			return true;
 		}
 		++fd_index;
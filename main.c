@@ -15,6 +15,7 @@
 #include <unistd.h>
 #include <wayland-client.h>
 #include <wordexp.h>
+#include "auth-stats.h"
 #include "background-image.h"
 #include "cairo.h"
 #include "comm.h"
@@ -22,9 +23,12 @@
 #include "loop.h"
 #include "password-buffer.h"
 #include "pool-buffer.h"
+#include "probe.h"
 #include "seat.h"
 #include "swaylock.h"
+#include "trace.h"
 #include "ext-session-lock-v1-client-protocol.h"
+#include "viewporter-client-protocol.h"
 
 static uint32_t parse_color(const char *color) {
 	if (color[0] == '#') {
@@ -63,6 +67,7 @@ static void daemonize(void) {
 		exit(1);
 	}
 	if (fork() == 0) {
+		trace_fork();
 		setsid();
 		close(fds[0]);
 		int devnull = open("/dev/null", O_RDWR);
@@ -74,6 +79,12 @@ static void daemonize(void) {
 			write(fds[1], &success, 1);
 			exit(1);
 		}
+		// This process takes over the password memory of its parent
+		if (!password_buffer_relock()) {
+			write(fds[1], &success, 1);
+			exit(1);
+		}
+		relock_comm_shared_region();
 		success = 1;
 		if (write(fds[1], &success, 1) != 1) {
 			exit(1);
@@ -95,21 +106,49 @@ static void destroy_surface(struct swaylock_surface *surface) {
 	if (surface->frame != NULL) {
 		wl_callback_destroy(surface->frame);
 	}
+	if (surface->child_frame != NULL) {
+		wl_callback_destroy(surface->child_frame);
+	}
+	if (surface->prerender_timer != NULL) {
+		loop_remove_timer(surface->state->eventloop, surface->prerender_timer);
+	}
 	wl_list_remove(&surface->link);
+	if (surface->state->focused_surface == surface) {
+		surface->state->focused_surface = NULL;
+	}
 	if (surface->ext_session_lock_surface_v1 != NULL) {
 		ext_session_lock_surface_v1_destroy(surface->ext_session_lock_surface_v1);
 	}
-	if (surface->subsurface) {
-		wl_subsurface_destroy(surface->subsurface);
+	if (surface->viewport) {
+		wp_viewport_destroy(surface->viewport);
 	}
-	if (surface->child) {
-		wl_surface_destroy(surface->child);
+	if (surface->image_subsurface) {
+		wl_subsurface_destroy(surface->image_subsurface);
+	}
+	if (surface->image_surface) {
+		wl_surface_destroy(surface->image_surface);
+	}
+	// The ring layer is the parent of the others
+	for (int i = INDICATOR_LAYER_COUNT - 1; i >= 0; --i) {
+		struct swaylock_indicator_layer *layer = &surface->layers[i];
+		if (layer->subsurface) {
+			wl_subsurface_destroy(layer->subsurface);
+		}
+		if (layer->surface) {
+			wl_surface_destroy(layer->surface);
+		}
 	}
 	if (surface->surface != NULL) {
 		wl_surface_destroy(surface->surface);
 	}
-	destroy_buffer(&surface->indicator_buffers[0]);
-	destroy_buffer(&surface->indicator_buffers[1]);
+	for (int i = 0; i < INDICATOR_LAYER_COUNT; ++i) {
+		struct swaylock_indicator_layer *layer = &surface->layers[i];
+		for (int j = 0; j < INDICATOR_LAYER_BUFFERS; ++j) {
+			destroy_buffer(&layer->buffers[j]);
+			free(layer->drawn[j].text);
+			free(layer->drawn[j].layout_text);
+		}
+	}
 	wl_output_release(surface->output);
 	free(surface);
 }
@@ -119,13 +158,6 @@ static const struct ext_session_lock_surface_v1_listener ext_session_lock_surfac
 static cairo_surface_t *select_image(struct swaylock_state *state,
 		struct swaylock_surface *surface);
 
-static bool surface_is_opaque(struct swaylock_surface *surface) {
-	if (surface->image) {
-		return cairo_surface_get_content(surface->image) == CAIRO_CONTENT_COLOR;
-	}
-	return (surface->state->args.colors.background & 0xff) == 0xff;
-}
-
 static void create_surface(struct swaylock_surface *surface) {
 	struct swaylock_state *state = surface->state;
 
@@ -134,20 +166,46 @@ static void create_surface(struct swaylock_surface *surface) {
 	surface->surface = wl_compositor_create_surface(state->compositor);
 	assert(surface->surface);
 
-	surface->child = wl_compositor_create_surface(state->compositor);
-	assert(surface->child);
-	surface->subsurface = wl_subcompositor_get_subsurface(state->subcompositor, surface->child, surface->surface);
-	assert(surface->subsurface);
-	wl_subsurface_set_sync(surface->subsurface);
+	// An image which does not cover the output gets its own subsurface, below
+	// the indicator, so that it does not need a buffer as large as the output
+	if (surface->image && (state->args.mode == BACKGROUND_MODE_FIT ||
+			state->args.mode == BACKGROUND_MODE_CENTER)) {
+		surface->image_surface = wl_compositor_create_surface(state->compositor);
+		assert(surface->image_surface);
+		surface->image_subsurface = wl_subcompositor_get_subsurface(
+			state->subcompositor, surface->image_surface, surface->surface);
+		assert(surface->image_subsurface);
+		wl_subsurface_set_sync(surface->image_subsurface);
+	}
+	bool color_only = !surface->image || surface->image_surface ||
+		state->args.mode == BACKGROUND_MODE_SOLID_COLOR;
+	if (color_only && state->viewporter) {
+		surface->viewport = wp_viewporter_get_viewport(state->viewporter,
+			surface->surface);
+	}
+
+	// The text and highlight layers are children of the ring layer, each new
+	// one above the previous ones, and stay synchronized with it so that the
+	// layers change together when it is committed
+	struct swaylock_indicator_layer *ring = &surface->layers[INDICATOR_LAYER_RING];
+	for (int i = 0; i < INDICATOR_LAYER_COUNT; ++i) {
+		struct swaylock_indicator_layer *layer = &surface->layers[i];
+		layer->surface = wl_compositor_create_surface(state->compositor);
+		assert(layer->surface);
+		layer->subsurface = wl_subcompositor_get_subsurface(state->subcompositor,
+			layer->surface, layer == ring ? surface->surface : ring->surface);
+		assert(layer->subsurface);
+		// The ring layer is desynchronized once the first frame is committed
+		wl_subsurface_set_sync(layer->subsurface);
+	}
+	surface->child_sync = true;
 
 	surface->ext_session_lock_surface_v1 = ext_session_lock_v1_get_lock_surface(
 		state->ext_session_lock_v1, surface->surface, surface->output);
 	ext_session_lock_surface_v1_add_listener(surface->ext_session_lock_surface_v1,
 		&ext_session_lock_surface_v1_listener, surface);
 
-	if (surface_is_opaque(surface) &&
-			surface->state->args.mode != BACKGROUND_MODE_CENTER &&
-			surface->state->args.mode != BACKGROUND_MODE_FIT) {
+	if (surface_is_opaque(surface)) {
 		struct wl_region *region =
 			wl_compositor_create_region(surface->state->compositor);
 		wl_region_add(region, 0, 0, INT32_MAX, INT32_MAX);
@@ -176,43 +234,142 @@ static const struct ext_session_lock_surface_v1_listener ext_session_lock_surfac
 void damage_state(struct swaylock_state *state) {
 	struct swaylock_surface *surface;
 	wl_list_for_each(surface, &state->surfaces, link) {
+		// Outputs without the indicator keep showing their background
+		if (!surface_shows_indicator(surface)) {
+			continue;
+		}
 		surface->dirty = true;
 		render(surface);
 	}
 }
 
+static struct swaylock_surface *get_primary_surface(struct swaylock_state *state) {
+	// Wayland has no notion of a primary output, so use the one which was
+	// announced first
+	struct swaylock_surface *primary = NULL, *surface;
+	wl_list_for_each(surface, &state->surfaces, link) {
+		if (!primary || surface->output_global_name < primary->output_global_name) {
+			primary = surface;
+		}
+	}
+	return primary;
+}
+
+bool surface_shows_indicator(struct swaylock_surface *surface) {
+	struct swaylock_state *state = surface->state;
+	const char *output = state->args.indicator_output;
+	if (!output) {
+		return true;
+	}
+	if (strcmp(output, "focused") == 0) {
+		// Until an output has focus, the indicator is on the primary one
+		if (state->focused_surface) {
+			return surface == state->focused_surface;
+		}
+		return surface == get_primary_surface(state);
+	}
+	if (strcmp(output, "primary") == 0) {
+		return surface == get_primary_surface(state);
+	}
+
+	struct swaylock_surface *named;
+	wl_list_for_each(named, &state->surfaces, link) {
+		if (named->output_name && strcmp(named->output_name, output) == 0) {
+			return surface == named;
+		}
+	}
+	// Rather than showing no feedback at all, the indicator is on the primary
+	// output until the named one is announced
+	static bool warned = false;
+	if (!warned) {
+		swaylock_log(LOG_ERROR, "No output named %s, showing the indicator "
+			"on the primary output", output);
+		warned = true;
+	}
+	return surface == get_primary_surface(state);
+}
+
+void focus_surface(struct swaylock_state *state, struct wl_surface *wl_surface) {
+	struct swaylock_surface *focused = NULL, *surface;
+	wl_list_for_each(surface, &state->surfaces, link) {
+		bool found = surface->surface == wl_surface ||
+			surface->image_surface == wl_surface;
+		for (int i = 0; i < INDICATOR_LAYER_COUNT; ++i) {
+			found = found || surface->layers[i].surface == wl_surface;
+		}
+		if (found) {
+			focused = surface;
+			break;
+		}
+	}
+	if (!focused || focused == state->focused_surface) {
+		return;
+	}
+
+	struct swaylock_surface *previous = state->focused_surface;
+	state->focused_surface = focused;
+	if (!state->args.indicator_output ||
+			strcmp(state->args.indicator_output, "focused") != 0) {
+		return;
+	}
+	// Move the indicator, which may have been shown on the primary output
+	// until now
+	if (!previous) {
+		previous = get_primary_surface(state);
+	}
+	if (previous && previous != focused) {
+		previous->dirty = true;
+		render(previous);
+	}
+	focused->dirty = true;
+	render(focused);
+}
+
 static void handle_wl_output_geometry(void *data, struct wl_output *wl_output,
 		int32_t x, int32_t y, int32_t width_mm, int32_t height_mm,
 		int32_t subpixel, const char *make, const char *model,
 		int32_t transform) {
 	struct swaylock_surface *surface = data;
-	surface->subpixel = subpixel;
-	if (surface->state->run_display) {
-		surface->dirty = true;
-		render(surface);
-	}
+	surface->pending_subpixel = subpixel;
 }
 
 static void handle_wl_output_mode(void *data, struct wl_output *output,
 		uint32_t flags, int32_t width, int32_t height, int32_t refresh) {
-	// Who cares
+	struct swaylock_surface *surface = data;
+	if (flags & WL_OUTPUT_MODE_CURRENT) {
+		surface->pending_refresh = refresh;
+	}
 }
 
 static void handle_wl_output_done(void *data, struct wl_output *output) {
 	struct swaylock_surface *surface = data;
+	bool changed = surface->scale != surface->pending_scale ||
+		surface->subpixel != surface->pending_subpixel;
+	surface->scale = surface->pending_scale;
+	surface->subpixel = surface->pending_subpixel;
+	if (surface->refresh != surface->pending_refresh) {
+		surface->refresh = surface->pending_refresh;
+		swaylock_log(LOG_DEBUG, "Output %s refreshes at %d.%03d Hz",
+			surface->output_name ? surface->output_name : "(unnamed)",
+			surface->refresh / 1000, surface->refresh % 1000);
+	}
+
 	if (!surface->created && surface->state->run_display) {
 		create_surface(surface);
+		// The indicator may move to the new output
+		if (surface->state->args.indicator_output) {
+			damage_state(surface->state);
+		}
+	} else if (changed && surface->state->run_display) {
+		surface->dirty = true;
+		render(surface);
 	}
 }
 
 static void handle_wl_output_scale(void *data, struct wl_output *output,
 		int32_t factor) {
 	struct swaylock_surface *surface = data;
-	surface->scale = factor;
-	if (surface->state->run_display) {
-		surface->dirty = true;
-		render(surface);
-	}
+	surface->pending_scale = factor;
 }
 
 static void handle_wl_output_name(void *data, struct wl_output *output,
@@ -238,6 +395,8 @@ struct wl_output_listener _wl_output_listener = {
 static void ext_session_lock_v1_handle_locked(void *data, struct ext_session_lock_v1 *lock) {
 	struct swaylock_state *state = data;
 	state->locked = true;
+	trace_instant("locked");
+	SWAYLOCK_PROBE(locked);
 }
 
 static void ext_session_lock_v1_handle_finished(void *data, struct ext_session_lock_v1 *lock) {
@@ -260,9 +419,13 @@ static void handle_global(void *data, struct wl_registry *registry,
 	} else if (strcmp(interface, wl_subcompositor_interface.name) == 0) {
 		state->subcompositor = wl_registry_bind(registry, name,
 				&wl_subcompositor_interface, 1);
+	} else if (strcmp(interface, wp_viewporter_interface.name) == 0) {
+		state->viewporter = wl_registry_bind(registry, name,
+				&wp_viewporter_interface, 1);
 	} else if (strcmp(interface, wl_shm_interface.name) == 0) {
 		state->shm = wl_registry_bind(registry, name,
 				&wl_shm_interface, 1);
+		listen_shm_formats(state->shm);
 	} else if (strcmp(interface, wl_seat_interface.name) == 0) {
 		struct wl_seat *seat = wl_registry_bind(
 				registry, name, &wl_seat_interface, 4);
@@ -292,6 +455,10 @@ static void handle_global_remove(void *data, struct wl_registry *registry,
 	wl_list_for_each(surface, &state->surfaces, link) {
 		if (surface->output_global_name == name) {
 			destroy_surface(surface);
+			// The indicator may move to another output
+			if (state->args.indicator_output) {
+				damage_state(state);
+			}
 			break;
 		}
 	}
@@ -305,7 +472,7 @@ static const struct wl_registry_listener registry_listener = {
 static int sigusr_fds[2] = {-1, -1};
 
 void do_sigusr(int sig) {
-	(void)write(sigusr_fds[1], "1", 1);
+	(void)write(sigusr_fds[1], sig == SIGUSR2 ? "2" : "1", 1);
 }
 
 static cairo_surface_t *select_image(struct swaylock_state *state,
@@ -399,46 +566,6 @@ static void load_image(char *arg, struct swaylock_state *state) {
 			image->output_name ? image->output_name : "*");
 }
 
-static void set_default_colors(struct swaylock_colors *colors) {
-	colors->background = 0xA3A3A3FF;
-	colors->bs_highlight = 0xDB3300FF;
-	colors->key_highlight = 0x33DB00FF;
-	colors->caps_lock_bs_highlight = 0xDB3300FF;
-	colors->caps_lock_key_highlight = 0x33DB00FF;
-	colors->separator = 0x000000FF;
-	colors->layout_background = 0x000000C0;
-	colors->layout_border = 0x00000000;
-	colors->layout_text = 0xFFFFFFFF;
-	colors->inside = (struct swaylock_colorset){
-		.input = 0x000000C0,
-		.cleared = 0xE5A445C0,
-		.caps_lock = 0x000000C0,
-		.verifying = 0x0072FFC0,
-		.wrong = 0xFA0000C0,
-	};
-	colors->line = (struct swaylock_colorset){
-		.input = 0x000000FF,
-		.cleared = 0x000000FF,
-		.caps_lock = 0x000000FF,
-		.verifying = 0x000000FF,
-		.wrong = 0x000000FF,
-	};
-	colors->ring = (struct swaylock_colorset){
-		.input = 0x337D00FF,
-		.cleared = 0xE5A445FF,
-		.caps_lock = 0xE5A445FF,
-		.verifying = 0x3300FFFF,
-		.wrong = 0x7D3300FF,
-	};
-	colors->text = (struct swaylock_colorset){
-		.input = 0xE5A445FF,
-		.cleared = 0x000000FF,
-		.caps_lock = 0xE5A445FF,
-		.verifying = 0x000000FF,
-		.wrong = 0x000000FF,
-	};
-}
-
 enum line_mode {
 	LM_LINE,
 	LM_INSIDE,
@@ -448,7 +575,9 @@ enum line_mode {
 static int parse_options(int argc, char **argv, struct swaylock_state *state,
 		enum line_mode *line_mode, char **config_path) {
 	enum long_option_codes {
-		LO_BS_HL_COLOR = 256,
+		LO_AUTH_HELPER = 256,
+		LO_BACKOFF,
+		LO_BS_HL_COLOR,
 		LO_CAPS_LOCK_BS_HL_COLOR,
 		LO_CAPS_LOCK_KEY_HL_COLOR,
 		LO_FONT,
@@ -457,13 +586,16 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 		LO_IND_RADIUS,
 		LO_IND_X_POSITION,
 		LO_IND_Y_POSITION,
+		LO_IND_OUTPUT,
 		LO_IND_THICKNESS,
+		LO_IMMEDIATE_PAM_SERVICE,
 		LO_INSIDE_COLOR,
 		LO_INSIDE_CLEAR_COLOR,
 		LO_INSIDE_CAPS_LOCK_COLOR,
 		LO_INSIDE_VER_COLOR,
 		LO_INSIDE_WRONG_COLOR,
 		LO_KEY_HL_COLOR,
+		LO_LOW_MEMORY,
 		LO_LAYOUT_TXT_COLOR,
 		LO_LAYOUT_BG_COLOR,
 		LO_LAYOUT_BORDER_COLOR,
@@ -505,6 +637,8 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 		{"hide-keyboard-layout", no_argument, NULL, 'K'},
 		{"show-failed-attempts", no_argument, NULL, 'F'},
 		{"version", no_argument, NULL, 'v'},
+		{"auth-helper", required_argument, NULL, LO_AUTH_HELPER},
+		{"backoff", required_argument, NULL, LO_BACKOFF},
 		{"bs-hl-color", required_argument, NULL, LO_BS_HL_COLOR},
 		{"caps-lock-bs-hl-color", required_argument, NULL, LO_CAPS_LOCK_BS_HL_COLOR},
 		{"caps-lock-key-hl-color", required_argument, NULL, LO_CAPS_LOCK_KEY_HL_COLOR},
@@ -515,6 +649,8 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 		{"indicator-thickness", required_argument, NULL, LO_IND_THICKNESS},
 		{"indicator-x-position", required_argument, NULL, LO_IND_X_POSITION},
 		{"indicator-y-position", required_argument, NULL, LO_IND_Y_POSITION},
+		{"indicator-output", required_argument, NULL, LO_IND_OUTPUT},
+		{"immediate-pam-service", required_argument, NULL, LO_IMMEDIATE_PAM_SERVICE},
 		{"inside-color", required_argument, NULL, LO_INSIDE_COLOR},
 		{"inside-clear-color", required_argument, NULL, LO_INSIDE_CLEAR_COLOR},
 		{"inside-caps-lock-color", required_argument, NULL, LO_INSIDE_CAPS_LOCK_COLOR},
@@ -529,6 +665,7 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 		{"line-caps-lock-color", required_argument, NULL, LO_LINE_CAPS_LOCK_COLOR},
 		{"line-ver-color", required_argument, NULL, LO_LINE_VER_COLOR},
 		{"line-wrong-color", required_argument, NULL, LO_LINE_WRONG_COLOR},
+		{"low-memory", no_argument, NULL, LO_LOW_MEMORY},
 		{"ring-color", required_argument, NULL, LO_RING_COLOR},
 		{"ring-clear-color", required_argument, NULL, LO_RING_CLEAR_COLOR},
 		{"ring-caps-lock-color", required_argument, NULL, LO_RING_CAPS_LOCK_COLOR},
@@ -580,6 +717,10 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 			"Disable the unlock indicator.\n"
 		"  -v, --version                    "
 			"Show the version number and quit.\n"
+		"  --auth-helper <command>          "
+			"Also unlock when the given command exits successfully.\n"
+		"  --backoff <mode>                 "
+			"Delay after a wrong password: none, fixed, exponential.\n"
 		"  --bs-hl-color <color>            "
 			"Sets the color of backspace highlight segments.\n"
 		"  --caps-lock-bs-hl-color <color>  "
@@ -602,6 +743,11 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 			"Sets the horizontal position of the indicator.\n"
 		"  --indicator-y-position <y>       "
 			"Sets the vertical position of the indicator.\n"
+		"  --indicator-output <output>      "
+			"Shows the indicator only on the named, focused or primary output.\n"
+		"  --immediate-pam-service <name>   "
+			"Also authenticate with the given PAM service as soon as the "
+			"screen is locked.\n"
 		"  --inside-color <color>           "
 			"Sets the color of the inside of the indicator.\n"
 		"  --inside-clear-color <color>     "
@@ -635,6 +781,8 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 		"  --line-wrong-color <color>       "
 			"Sets the color of the line between the inside and ring when "
 			"invalid.\n"
+		"  --low-memory                     "
+			"Use 16 bits per pixel for opaque backgrounds, if supported.\n"
 		"  -n, --line-uses-inside           "
 			"Use the inside color for the line between the inside and ring.\n"
 		"  -r, --line-uses-ring             "
@@ -780,6 +928,20 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 				state->args.colors.caps_lock_key_highlight = parse_color(optarg);
 			}
 			break;
+		case LO_AUTH_HELPER:
+			if (state) {
+				free(state->args.auth_helper);
+				state->args.auth_helper = strdup(optarg);
+			}
+			break;
+		case LO_BACKOFF:
+			if (state) {
+				state->args.backoff = parse_backoff_mode(optarg);
+				if (state->args.backoff == BACKOFF_MODE_INVALID) {
+					return 1;
+				}
+			}
+			break;
 		case LO_FONT:
 			if (state) {
 				free(state->args.font);
@@ -818,6 +980,18 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 				state->args.indicator_y_position = atoi(optarg);
 			}
 			break;
+		case LO_IND_OUTPUT:
+			if (state) {
+				free(state->args.indicator_output);
+				state->args.indicator_output = strdup(optarg);
+			}
+			break;
+		case LO_IMMEDIATE_PAM_SERVICE:
+			if (state) {
+				free(state->args.immediate_pam_service);
+				state->args.immediate_pam_service = strdup(optarg);
+			}
+			break;
 		case LO_INSIDE_COLOR:
 			if (state) {
 				state->args.colors.inside.input = parse_color(optarg);
@@ -888,6 +1062,11 @@ static int parse_options(int argc, char **argv, struct swaylock_state *state,
 				state->args.colors.line.wrong = parse_color(optarg);
 			}
 			break;
+		case LO_LOW_MEMORY:
+			if (state) {
+				state->args.low_memory = true;
+			}
+			break;
 		case LO_RING_COLOR:
 			if (state) {
 				state->args.colors.ring.input = parse_color(optarg);
@@ -1031,24 +1210,79 @@ static int load_config(char *path, struct swaylock_state *state,
 static struct swaylock_state state;
 
 static void display_in(int fd, short mask, void *data) {
+	trace_begin("dispatch");
 	if (wl_display_dispatch(state.display) == -1) {
 		state.run_display = false;
 	}
+	trace_end("dispatch");
+}
+
+static void authenticated(void) {
+	clear_queued_password(&state);
+	cancel_comm_authenticators();
+	state.run_display = false;
+}
+
+static void authenticator_in(int fd, short mask, void *data) {
+	struct comm_channel *channel = data;
+	struct comm_reply reply;
+	if ((mask & POLLIN) && read_comm_reply(fd, &reply)) {
+		if (!reply.final) {
+			swaylock_log(LOG_INFO, "%s: %s", channel->name, reply.message);
+		} else if (reply.result == COMM_RESULT_SUCCESS) {
+			swaylock_log(LOG_DEBUG, "Authenticated by %s", channel->name);
+			authenticated();
+		} else {
+			swaylock_log(LOG_INFO, "Authenticator %s failed", channel->name);
+		}
+		return;
+	}
+
+	// Its failure must not prevent unlocking with the password
+	swaylock_log(LOG_DEBUG, "Authenticator %s exited", channel->name);
+	loop_remove_fd(state.eventloop, fd);
+	close_comm_authenticator(channel);
+}
+
+static void spawn_authenticators(void) {
+	struct comm_channel *channels[2] = {0};
+	if (state.args.immediate_pam_service) {
+		channels[0] = spawn_immediate_pam_child(
+			state.args.immediate_pam_service);
+	}
+	if (state.args.auth_helper) {
+		channels[1] = spawn_comm_helper(state.args.auth_helper);
+	}
+	for (size_t i = 0; i < sizeof(channels) / sizeof(channels[0]); ++i) {
+		if (channels[i]) {
+			loop_add_fd(state.eventloop, channels[i]->fd, POLLIN,
+				authenticator_in, channels[i]);
+		}
+	}
 }
 
 static void comm_in(int fd, short mask, void *data) {
 	if (mask & POLLIN) {
-		bool auth_success = false;
-		if (!read_comm_reply(&auth_success)) {
+		struct comm_reply reply;
+		if (!read_comm_reply(fd, &reply)) {
+			swaylock_log(LOG_ERROR, "Failed to read pw result");
 			exit(EXIT_FAILURE);
 		}
-		if (auth_success) {
+		if (reply.final && reply.id == state.auth_request) {
+			auth_stats_record(reply.result == COMM_RESULT_SUCCESS,
+				get_comm_time() - state.auth_start, &reply.timing);
+		}
+
+		if (!reply.final) {
+			swaylock_log(LOG_INFO, "%s", reply.message);
+		} else if (reply.result == COMM_RESULT_SUCCESS) {
 			// Authentication succeeded
-			state.run_display = false;
-		} else {
-			state.auth_state = AUTH_STATE_INVALID;
-			schedule_auth_idle(&state);
+			authenticated();
+		} else if (reply.result == COMM_RESULT_FAILURE) {
 			++state.failed_attempts;
+			if (reply.id == state.auth_request) {
+				handle_auth_failure(&state);
+			}
 			damage_state(&state);
 		}
 	} else if (mask & (POLLHUP | POLLERR)) {
@@ -1057,8 +1291,15 @@ static void comm_in(int fd, short mask, void *data) {
 	}
 }
 
-static void term_in(int fd, short mask, void *data) {
-	state.run_display = false;
+static void sigusr_in(int fd, short mask, void *data) {
+	char sig = '1';
+	(void)read(fd, &sig, 1);
+	if (sig == '2') {
+		auth_stats_log();
+		trace_dump();
+	} else {
+		state.run_display = false;
+	}
 }
 
 // Check for --debug 'early' we also apply the correct loglevel
@@ -1089,8 +1330,10 @@ void log_init(int argc, char **argv) {
 
 int main(int argc, char **argv) {
 	log_init(argc, argv);
+	trace_init();
 	initialize_pw_backend(argc, argv);
 	srand(time(NULL));
+	state.next_highlight_start = rand() % 2048;
 
 	enum line_mode line_mode = LM_LINE;
 	state.failed_attempts = 0;
@@ -1105,6 +1348,8 @@ int main(int argc, char **argv) {
 		.override_indicator_x_position = false,
 		.override_indicator_y_position = false,
 		.ignore_empty = false,
+		// PAM modules such as pam_faildelay impose their own delay
+		.backoff = HAVE_PAM ? BACKOFF_MODE_NONE : BACKOFF_MODE_FIXED,
 		.show_indicator = true,
 		.show_caps_lock_indicator = false,
 		.show_caps_lock_text = true,
@@ -1152,14 +1397,28 @@ int main(int argc, char **argv) {
 		state.args.colors.line = state.args.colors.ring;
 	}
 
+	if (!password_buffer_init()) {
+		return EXIT_FAILURE;
+	}
+
+	// Both grow as needed, up to COMM_PASSWORD_MAX
 	state.password.len = 0;
-	state.password.buffer_len = 1024;
+	state.password.buffer_len = 256;
 	state.password.buffer = password_buffer_create(state.password.buffer_len);
 	if (!state.password.buffer) {
 		return EXIT_FAILURE;
 	}
 	state.password.buffer[0] = 0;
 
+	state.queued_password.len = 0;
+	state.queued_password.buffer_len = state.password.buffer_len;
+	state.queued_password.buffer =
+		password_buffer_create(state.queued_password.buffer_len);
+	if (!state.queued_password.buffer) {
+		return EXIT_FAILURE;
+	}
+	state.queued_password.buffer[0] = 0;
+
 	if (pipe(sigusr_fds) != 0) {
 		swaylock_log(LOG_ERROR, "Failed to pipe");
 		return EXIT_FAILURE;
@@ -1208,6 +1467,8 @@ int main(int argc, char **argv) {
 		return 1;
 	}
 
+	trace_instant("lock_requested");
+	SWAYLOCK_PROBE(lock_requested);
 	state.ext_session_lock_v1 = ext_session_lock_manager_v1_lock(state.ext_session_lock_manager_v1);
 	ext_session_lock_v1_add_listener(state.ext_session_lock_v1,
 		&ext_session_lock_v1_listener, &state);
@@ -1243,19 +1504,26 @@ int main(int argc, char **argv) {
 	if (state.args.daemonize) {
 		daemonize();
 	}
+	// This is the process which stays until the session is unlocked
+	password_buffer_exclude_from_children();
 
 	loop_add_fd(state.eventloop, wl_display_get_fd(state.display), POLLIN,
 			display_in, NULL);
 
 	loop_add_fd(state.eventloop, get_comm_reply_fd(), POLLIN, comm_in, NULL);
 
-	loop_add_fd(state.eventloop, sigusr_fds[0], POLLIN, term_in, NULL);
+	// Only once locked, so that they cannot unlock a session which is not
+	// locked yet
+	spawn_authenticators();
+
+	loop_add_fd(state.eventloop, sigusr_fds[0], POLLIN, sigusr_in, NULL);
 
 	struct sigaction sa;
 	sa.sa_handler = do_sigusr;
 	sigemptyset(&sa.sa_mask);
 	sa.sa_flags = SA_RESTART;
 	sigaction(SIGUSR1, &sa, NULL);
+	sigaction(SIGUSR2, &sa, NULL);
 
 	state.run_display = true;
 	while (state.run_display) {
@@ -1266,10 +1534,18 @@ int main(int argc, char **argv) {
 		loop_poll(state.eventloop);
 	}
 
+	trace_instant("unlock_requested");
+	SWAYLOCK_PROBE(unlock_requested);
 	ext_session_lock_v1_unlock_and_destroy(state.ext_session_lock_v1);
 	wl_display_roundtrip(state.display);
+	trace_instant("unlocked");
+	SWAYLOCK_PROBE(unlocked);
+	auth_stats_log();
 
 	free(state.args.font);
+	free(state.args.indicator_output);
+	free(state.args.immediate_pam_service);
+	free(state.args.auth_helper);
 	cairo_destroy(state.test_cairo);
 	cairo_surface_destroy(state.test_surface);
 	return 0;
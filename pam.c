@@ -1,14 +1,16 @@
 #define _POSIX_C_SOURCE 200809L
+#include <errno.h>
 #include <pwd.h>
 #include <security/pam_appl.h>
 #include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include <unistd.h>
 #include "comm.h"
 #include "log.h"
-#include "password-buffer.h"
 #include "swaylock.h"
+#include "trace.h"
 
 void initialize_pw_backend(int argc, char **argv) {
 	if (getuid() != geteuid() || getgid() != getegid()) {
@@ -22,10 +24,42 @@ void initialize_pw_backend(int argc, char **argv) {
 	}
 }
 
+/* A build can read service files from its own directory, so that the
+ * authentication path can be exercised against a throwaway PAM stack, e.g. of
+ * pam_faildelay, pam_echo and pam_permit or pam_deny, without root. */
+static int start_pam(const char *service, const char *user,
+		const struct pam_conv *conv, pam_handle_t **handle) {
+#ifdef PAM_CONFDIR
+	return pam_start_confdir(service, user, conv, PAM_CONFDIR, handle);
+#else
+	return pam_start(service, user, conv, handle);
+#endif
+}
+
 struct conv_state {
+	uint32_t id;
 	char *password;
+	uint64_t delay; // time spent in fail_delay()
 };
 
+#ifdef PAM_FAIL_DELAY
+/* Called by Linux-PAM instead of sleeping itself after a failure, so that the
+ * delay can be told apart from the time spent checking the password. */
+static void fail_delay(int status, unsigned int usec, void *data) {
+	struct conv_state *state = data;
+	if (status == PAM_SUCCESS || usec == 0) {
+		return;
+	}
+	uint64_t start = get_comm_time();
+	struct timespec delay = {
+		.tv_sec = usec / 1000000,
+		.tv_nsec = (usec % 1000000) * 1000,
+	};
+	while (nanosleep(&delay, &delay) != 0 && errno == EINTR);
+	state->delay += get_comm_time() - start;
+}
+#endif
+
 static int handle_conversation(int num_msg, const struct pam_message **msg,
 		struct pam_response **resp, void *data) {
 	struct conv_state *state = data;
@@ -44,7 +78,8 @@ static int handle_conversation(int num_msg, const struct pam_message **msg,
 		case PAM_PROMPT_ECHO_ON:
 			/* workaround pam_systemd_home internal retries:
 			 * https://github.com/systemd/systemd/blob/main/src/home/pam_systemd_home.c#L594-L599
-			 * if the password has already been rejected once, abort the conversation */
+			 * if the password has already been rejected once, abort the conversation.
+			 * Immediate services never have a password to answer with. */
 			if (state->password == NULL) {
 				return PAM_ABORT;
 			}
@@ -57,6 +92,9 @@ static int handle_conversation(int num_msg, const struct pam_message **msg,
 			break;
 		case PAM_ERROR_MSG:
 		case PAM_TEXT_INFO:
+			if (!write_comm_status(state->id, msg[i]->msg)) {
+				return PAM_CONV_ERR;
+			}
 			break;
 		}
 	}
@@ -97,26 +135,40 @@ void run_pw_backend_child(void) {
 		.appdata_ptr = &state,
 	};
 	pam_handle_t *auth_handle = NULL;
-	if (pam_start("swaylock", username, &conv, &auth_handle) != PAM_SUCCESS) {
+	if (start_pam("swaylock", username, &conv, &auth_handle) != PAM_SUCCESS) {
 		swaylock_log(LOG_ERROR, "pam_start failed");
 		exit(EXIT_FAILURE);
 	}
 
+#ifdef PAM_FAIL_DELAY
+	pam_set_item(auth_handle, PAM_FAIL_DELAY, (const void *)fail_delay);
+#endif
+
 	/* This code does not run as root */
 	swaylock_log(LOG_DEBUG, "Prepared to authorize user %s", username);
 
 	int pam_status = PAM_SUCCESS;
 	while (1) {
-		ssize_t size = read_comm_request(&pw_buf);
+		uint32_t id;
+		ssize_t size = read_comm_request(&id, &pw_buf);
 		if (size < 0) {
 			exit(EXIT_FAILURE);
 		} else if (size == 0) {
 			break;
 		}
 
+		state.id = id;
 		state.password = pw_buf;
+		state.delay = 0;
+		trace_begin("authenticate");
+		uint64_t start = get_comm_time();
 		int pam_status = pam_authenticate(auth_handle, 0);
-		password_buffer_destroy(pw_buf, size);
+		struct comm_timing timing = {
+			.auth = get_comm_time() - start - state.delay,
+			.delay = state.delay,
+		};
+		trace_end("authenticate");
+		release_comm_request(pw_buf, size);
 		pw_buf = NULL;
 		state.password = NULL;
 
@@ -126,13 +178,15 @@ void run_pw_backend_child(void) {
 				get_pam_auth_error(pam_status));
 		}
 
-		if (!write_comm_reply(success)) {
+		if (!write_comm_reply(id,
+				success ? COMM_RESULT_SUCCESS : COMM_RESULT_FAILURE,
+				&timing)) {
 			exit(EXIT_FAILURE);
 		}
 
 		if (success) {
-			/* Unsuccessful requests may be queued after a successful one;
-			 * do not process them. */
+			/* swaylock unlocks and exits on the first success; nothing
+			 * else is left to check. */
 			break;
 		}
 	}
@@ -146,3 +200,51 @@ void run_pw_backend_child(void) {
 
 	exit((pam_status == PAM_SUCCESS) ? EXIT_SUCCESS : EXIT_FAILURE);
 }
+
+static void run_immediate_pam_child(void *data) {
+	const char *service = data;
+	struct passwd *passwd = getpwuid(getuid());
+	if (!passwd) {
+		swaylock_log_errno(LOG_ERROR, "getpwuid failed");
+		exit(EXIT_FAILURE);
+	}
+
+	struct conv_state state = {0};
+	const struct pam_conv conv = {
+		.conv = handle_conversation,
+		.appdata_ptr = &state,
+	};
+	pam_handle_t *auth_handle = NULL;
+	if (start_pam(service, passwd->pw_name, &conv, &auth_handle) != PAM_SUCCESS) {
+		swaylock_log(LOG_ERROR, "pam_start failed for %s", service);
+		exit(EXIT_FAILURE);
+	}
+
+	/* Modules such as pam_fprintd wait for the user themselves, and retry
+	 * up to their own limit before failing. */
+	trace_begin("authenticate");
+	int pam_status = pam_authenticate(auth_handle, 0);
+	trace_end("authenticate");
+
+	bool success = pam_status == PAM_SUCCESS;
+	if (success) {
+		pam_setcred(auth_handle, PAM_REFRESH_CRED);
+	} else {
+		swaylock_log(LOG_ERROR, "pam_authenticate failed for %s: %s",
+			service, get_pam_auth_error(pam_status));
+	}
+	bool written = write_comm_reply(0,
+		success ? COMM_RESULT_SUCCESS : COMM_RESULT_FAILURE, NULL);
+
+	if (pam_end(auth_handle, pam_status) != PAM_SUCCESS) {
+		swaylock_log(LOG_ERROR, "pam_end failed");
+		exit(EXIT_FAILURE);
+	}
+
+	exit((success && written) ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+
+struct comm_channel *spawn_immediate_pam_child(const char *service) {
+	return spawn_comm_authenticator(service, run_immediate_pam_child,
+		(void *)service);
+}
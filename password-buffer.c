@@ -1,15 +1,37 @@
+#undef _POSIX_C_SOURCE
+#define _DEFAULT_SOURCE // for MAP_ANONYMOUS and madvise()
 #include "password-buffer.h"
 #include "log.h"
 #include "swaylock.h"
+#include <assert.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <string.h>
 #include <errno.h>
 #include <unistd.h>
 #include <limits.h>
 #include <sys/mman.h>
 
-static bool mlock_supported = true;
+/*
+ * All secrets are allocated from a single arena, mapped once per process and
+ * surrounded by inaccessible guard pages. The arena is locked into memory and
+ * excluded from core dumps, so allocating a buffer for a password does not
+ * involve any system call. Where supported, it is also excluded from forked
+ * children once no fork() is left whose child would keep using it.
+ *
+ * The arena is split into granules, and each buffer takes a contiguous run of
+ * them. The arena is small enough for a linear first-fit search.
+ */
+#define ARENA_SIZE (16 * 1024)
+#define GRANULE_SIZE 64
+#define GRANULES (ARENA_SIZE / GRANULE_SIZE)
+
 static long int page_size = 0;
 
+static char *arena = NULL;
+static size_t arena_mapped = 0; // including the guard pages
+static bool granule_used[GRANULES];
+
 static long int get_page_size() {
 	if (!page_size) {
 		page_size = sysconf(_SC_PAGESIZE);
@@ -31,7 +53,6 @@ static bool password_buffer_lock(char *addr, size_t size) {
 			break;
 		case EPERM:
 			swaylock_log_errno(LOG_ERROR, "Unable to mlock() password memory: Unsupported!");
-			mlock_supported = false;
 			return true;
 		default:
 			swaylock_log_errno(LOG_ERROR, "Unable to mlock() password memory.");
@@ -42,38 +63,94 @@ static bool password_buffer_lock(char *addr, size_t size) {
 	return true;
 }
 
-// password_buffer_unlock expects addr to be page alligned
-static bool password_buffer_unlock(char *addr, size_t size) {
-	if (mlock_supported) {
-		if (munlock(addr, size) != 0) {
-			swaylock_log_errno(LOG_ERROR, "Unable to munlock() password memory.");
-			return false;
-		}
+static void password_buffer_advise(char *addr, size_t size) {
+#if defined(MADV_DONTDUMP)
+	if (madvise(addr, size, MADV_DONTDUMP) != 0) {
+		swaylock_log_errno(LOG_ERROR, "Unable to exclude password memory from core dumps.");
+	}
+#elif defined(MADV_NOCORE)
+	if (madvise(addr, size, MADV_NOCORE) != 0) {
+		swaylock_log_errno(LOG_ERROR, "Unable to exclude password memory from core dumps.");
 	}
+#endif
+}
 
+bool password_buffer_init(void) {
+	// A forked child must not use the arena of its parent, whether or not it
+	// was inherited
+	if (arena) {
+		munmap(arena - get_page_size(), arena_mapped);
+		arena = NULL;
+	}
+	memset(granule_used, 0, sizeof(granule_used));
+
+	long int page = get_page_size();
+	size_t size = (ARENA_SIZE + page - 1) / page * page;
+	arena_mapped = size + 2 * page;
+	char *mapping = mmap(NULL, arena_mapped, PROT_NONE,
+		MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (mapping == MAP_FAILED) {
+		swaylock_log_errno(LOG_ERROR, "failed to map password memory");
+		return false;
+	}
+	if (mprotect(mapping + page, size, PROT_READ | PROT_WRITE) != 0) {
+		swaylock_log_errno(LOG_ERROR, "failed to map password memory");
+		munmap(mapping, arena_mapped);
+		return false;
+	}
+	if (!password_buffer_lock(mapping + page, size)) {
+		munmap(mapping, arena_mapped);
+		return false;
+	}
+	password_buffer_advise(mapping + page, size);
+
+	arena = mapping + page;
 	return true;
 }
 
 char *password_buffer_create(size_t size) {
-	void *buffer;
-	int result = posix_memalign(&buffer, get_page_size(), size);
-	if (result) {
-		//posix_memalign doesn't set errno according to the man page
-		errno = result;
-		swaylock_log_errno(LOG_ERROR, "failed to alloc password buffer");
-		return NULL;
+	assert(arena);
+	size_t count = (size + GRANULE_SIZE - 1) / GRANULE_SIZE;
+	size_t run = 0;
+	for (size_t i = 0; i < GRANULES; ++i) {
+		run = granule_used[i] ? 0 : run + 1;
+		if (run == count) {
+			size_t start = i + 1 - count;
+			memset(&granule_used[start], true, count);
+			return &arena[start * GRANULE_SIZE];
+		}
 	}
+	swaylock_log(LOG_ERROR, "failed to alloc password buffer: out of memory");
+	return NULL;
+}
 
-	if (!password_buffer_lock(buffer, size)) {
-		free(buffer);
+char *password_buffer_resize(char *buffer, size_t size, size_t new_size) {
+	char *new_buffer = password_buffer_create(new_size);
+	if (!new_buffer) {
 		return NULL;
 	}
-
-	return buffer;
+	memcpy(new_buffer, buffer, size < new_size ? size : new_size);
+	password_buffer_destroy(buffer, size);
+	return new_buffer;
 }
 
 void password_buffer_destroy(char *buffer, size_t size) {
 	clear_buffer(buffer, size);
-	password_buffer_unlock(buffer, size);
-	free(buffer);
+	size_t start = (buffer - arena) / GRANULE_SIZE;
+	size_t count = (size + GRANULE_SIZE - 1) / GRANULE_SIZE;
+	memset(&granule_used[start], false, count);
+}
+
+bool password_buffer_relock(void) {
+	assert(arena);
+	return password_buffer_lock(arena, arena_mapped - 2 * get_page_size());
+}
+
+void password_buffer_exclude_from_children(void) {
+	assert(arena);
+#ifdef MADV_DONTFORK
+	if (madvise(arena - get_page_size(), arena_mapped, MADV_DONTFORK) != 0) {
+		swaylock_log_errno(LOG_ERROR, "Unable to exclude password memory from children.");
+	}
+#endif
 }
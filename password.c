@@ -8,8 +8,11 @@
 #include "comm.h"
 #include "log.h"
 #include "loop.h"
+#include "password-buffer.h"
+#include "probe.h"
 #include "seat.h"
 #include "swaylock.h"
+#include "trace.h"
 #include "unicode.h"
 
 void clear_buffer(char *buf, size_t size) {
@@ -35,9 +38,34 @@ static bool backspace(struct swaylock_password *pw) {
 	return false;
 }
 
+// Grows the buffer to fit size bytes, up to the longest password which can be
+// checked
+static bool reserve_password_buffer(struct swaylock_password *pw, size_t size) {
+	if (size <= pw->buffer_len) {
+		return true;
+	} else if (size > COMM_PASSWORD_MAX) {
+		return false;
+	}
+	size_t buffer_len = pw->buffer_len;
+	while (buffer_len < size) {
+		buffer_len *= 2;
+	}
+	if (buffer_len > COMM_PASSWORD_MAX) {
+		buffer_len = COMM_PASSWORD_MAX;
+	}
+	char *buffer = password_buffer_resize(pw->buffer, pw->buffer_len,
+		buffer_len);
+	if (!buffer) {
+		return false;
+	}
+	pw->buffer = buffer;
+	pw->buffer_len = buffer_len;
+	return true;
+}
+
 static void append_ch(struct swaylock_password *pw, uint32_t codepoint) {
 	size_t utf8_size = utf8_chsize(codepoint);
-	if (pw->len + utf8_size + 1 >= pw->buffer_len) {
+	if (!reserve_password_buffer(pw, pw->len + utf8_size + 1)) {
 		// TODO: Display error
 		return;
 	}
@@ -75,6 +103,13 @@ static void cancel_input_idle(struct swaylock_state *state) {
 	}
 }
 
+static void cancel_auth_idle(struct swaylock_state *state) {
+	if (state->auth_idle_timer) {
+		loop_remove_timer(state->eventloop, state->auth_idle_timer);
+		state->auth_idle_timer = NULL;
+	}
+}
+
 void schedule_auth_idle(struct swaylock_state *state) {
 	if (state->auth_idle_timer) {
 		loop_remove_timer(state->eventloop, state->auth_idle_timer);
@@ -107,35 +142,140 @@ static void cancel_password_clear(struct swaylock_state *state) {
 	}
 }
 
+static void send_password(struct swaylock_state *state,
+		struct swaylock_password *pw) {
+	state->auth_state = AUTH_STATE_VALIDATING;
+	state->auth_start = get_comm_time();
+	state->auth_request = write_comm_request(pw);
+	if (!state->auth_request) {
+		state->auth_state = AUTH_STATE_INVALID;
+		schedule_auth_idle(state);
+	}
+}
+
 static void submit_password(struct swaylock_state *state) {
 	if (state->args.ignore_empty && state->password.len == 0) {
 		return;
 	}
-	if (state->auth_state == AUTH_STATE_VALIDATING) {
+	if (state->backoff_remaining > 0) {
+		// Rejected, but kept so that it can be submitted again once the
+		// countdown is over
 		return;
 	}
 
+	SWAYLOCK_PROBE(submit_password);
 	state->input_state = INPUT_STATE_IDLE;
-	state->auth_state = AUTH_STATE_VALIDATING;
 	cancel_password_clear(state);
 	cancel_input_idle(state);
 
-	if (!write_comm_request(&state->password)) {
-		state->auth_state = AUTH_STATE_INVALID;
-		schedule_auth_idle(state);
+	if (state->auth_state == AUTH_STATE_VALIDATING) {
+		// Hold on to the password until the attempt in progress fails,
+		// replacing any attempt which was already queued
+		struct swaylock_password *queued = &state->queued_password;
+		clear_password_buffer(queued);
+		if (!reserve_password_buffer(queued, state->password.len + 1)) {
+			clear_password_buffer(&state->password);
+			damage_state(state);
+			return;
+		}
+		memcpy(queued->buffer, state->password.buffer,
+			state->password.len + 1);
+		queued->len = state->password.len;
+		state->password_queued = true;
+		clear_password_buffer(&state->password);
+	} else {
+		send_password(state, &state->password);
+	}
+
+	damage_state(state);
+}
+
+// Sends the queued password, if any, to be checked
+static bool submit_queued_password(struct swaylock_state *state) {
+	if (!state->password_queued) {
+		return false;
+	}
+	state->password_queued = false;
+	send_password(state, &state->queued_password);
+	return true;
+}
+
+void clear_queued_password(struct swaylock_state *state) {
+	clear_password_buffer(&state->queued_password);
+	state->password_queued = false;
+}
+
+enum backoff_mode parse_backoff_mode(const char *mode) {
+	if (strcmp(mode, "none") == 0) {
+		return BACKOFF_MODE_NONE;
+	} else if (strcmp(mode, "fixed") == 0) {
+		return BACKOFF_MODE_FIXED;
+	} else if (strcmp(mode, "exponential") == 0) {
+		return BACKOFF_MODE_EXPONENTIAL;
+	}
+	swaylock_log(LOG_ERROR, "Unsupported backoff mode: %s", mode);
+	return BACKOFF_MODE_INVALID;
+}
+
+// Returns the backoff after the latest failure, in seconds
+static int get_backoff(struct swaylock_state *state) {
+	switch (state->args.backoff) {
+	case BACKOFF_MODE_FIXED:
+		return 2;
+	case BACKOFF_MODE_EXPONENTIAL:
+		if (state->failed_attempts > 6) {
+			return 60;
+		}
+		return 1 << (state->failed_attempts - 1);
+	default:
+		return 0;
 	}
+}
 
+static void backoff_tick(void *data) {
+	struct swaylock_state *state = data;
+	state->backoff_timer = NULL;
+	if (--state->backoff_remaining > 0) {
+		state->backoff_timer = loop_add_timer(
+			state->eventloop, 1000, backoff_tick, state);
+	} else if (!submit_queued_password(state)) {
+		state->auth_state = AUTH_STATE_IDLE;
+	}
 	damage_state(state);
 }
 
+void handle_auth_failure(struct swaylock_state *state) {
+	int backoff = get_backoff(state);
+	if (backoff == 0) {
+		if (!submit_queued_password(state)) {
+			state->auth_state = AUTH_STATE_INVALID;
+			schedule_auth_idle(state);
+		}
+		return;
+	}
+
+	// A queued password waits for the end of the countdown
+	swaylock_log(LOG_DEBUG, "Backing off for %d seconds", backoff);
+	state->auth_state = AUTH_STATE_INVALID;
+	cancel_auth_idle(state);
+	state->backoff_remaining = backoff;
+	state->backoff_timer = loop_add_timer(
+		state->eventloop, 1000, backoff_tick, state);
+}
+
 static void update_highlight(struct swaylock_state *state) {
-	// Advance a random amount between 1/4 and 3/4 of a full turn
-	state->highlight_start =
+	state->highlight_start = state->next_highlight_start;
+	// Advance a random amount between 1/4 and 3/4 of a full turn. The next
+	// position is chosen now, so that it can be drawn ahead of time.
+	state->next_highlight_start =
 		(state->highlight_start + (rand() % 1024) + 512) % 2048;
 }
 
 void swaylock_handle_key(struct swaylock_state *state,
 		xkb_keysym_t keysym, uint32_t codepoint) {
+	// The key itself is deliberately not exposed to tracing
+	SWAYLOCK_PROBE(handle_key);
+	trace_begin("handle_key");
 
 	switch (keysym) {
 	case XKB_KEY_KP_Enter: /* fallthrough */
@@ -214,4 +354,6 @@ void swaylock_handle_key(struct swaylock_state *state,
 		}
 		break;
 	}
+
+	trace_end("handle_key");
 }
@@ -10,6 +10,7 @@
 #include <unistd.h>
 #include <wayland-client.h>
 #include "pool-buffer.h"
+#include "probe.h"
 
 static int anonymous_shm_open(void) {
 	int retries = 100;
@@ -36,6 +37,44 @@ static int anonymous_shm_open(void) {
 	return -1;
 }
 
+// ARGB8888 and XRGB8888 are supported by all compositors
+static bool rgb565_supported = false;
+
+static void shm_handle_format(void *data, struct wl_shm *shm, uint32_t format) {
+	if (format == WL_SHM_FORMAT_RGB565) {
+		rgb565_supported = true;
+	}
+}
+
+static const struct wl_shm_listener shm_listener = {
+	.format = shm_handle_format,
+};
+
+void listen_shm_formats(struct wl_shm *shm) {
+	wl_shm_add_listener(shm, &shm_listener, NULL);
+}
+
+bool shm_format_supported(uint32_t format) {
+	switch (format) {
+	case WL_SHM_FORMAT_ARGB8888:
+	case WL_SHM_FORMAT_XRGB8888:
+		return true;
+	case WL_SHM_FORMAT_RGB565:
+		return rgb565_supported;
+	}
+	return false;
+}
+
+static cairo_format_t get_cairo_format(uint32_t format) {
+	switch (format) {
+	case WL_SHM_FORMAT_XRGB8888:
+		return CAIRO_FORMAT_RGB24;
+	case WL_SHM_FORMAT_RGB565:
+		return CAIRO_FORMAT_RGB16_565;
+	}
+	return CAIRO_FORMAT_ARGB32;
+}
+
 static void buffer_release(void *data, struct wl_buffer *wl_buffer) {
 	struct pool_buffer *buffer = data;
 	buffer->busy = false;
@@ -48,7 +87,8 @@ static const struct wl_buffer_listener buffer_listener = {
 struct pool_buffer *create_buffer(struct wl_shm *shm,
 		struct pool_buffer *buf, int32_t width, int32_t height,
 		uint32_t format) {
-	uint32_t stride = width * 4;
+	cairo_format_t cairo_format = get_cairo_format(format);
+	uint32_t stride = cairo_format_stride_for_width(cairo_format, width);
 	size_t size = stride * height;
 
 	void *data = NULL;
@@ -75,7 +115,7 @@ struct pool_buffer *create_buffer(struct wl_shm *shm,
 	buf->height = height;
 	buf->data = data;
 	buf->surface = cairo_image_surface_create_for_data(data,
-			CAIRO_FORMAT_ARGB32, width, height, stride);
+			cairo_format, width, height, stride);
 	buf->cairo = cairo_create(buf->surface);
 	return buf;
 }
@@ -96,6 +136,24 @@ void destroy_buffer(struct pool_buffer *buffer) {
 	memset(buffer, 0, sizeof(struct pool_buffer));
 }
 
+struct pool_buffer *reuse_buffer(struct wl_shm *shm,
+		struct pool_buffer *buffer, uint32_t width, uint32_t height) {
+	if (buffer->width != width || buffer->height != height) {
+		destroy_buffer(buffer);
+	}
+
+	if (!buffer->buffer) {
+		SWAYLOCK_PROBE(buffer_alloc, width, height);
+		if (!create_buffer(shm, buffer, width, height,
+					WL_SHM_FORMAT_ARGB8888)) {
+			return NULL;
+		}
+	} else {
+		SWAYLOCK_PROBE(buffer_reuse, width, height);
+	}
+	return buffer;
+}
+
 struct pool_buffer *get_next_buffer(struct wl_shm *shm,
 		struct pool_buffer pool[static 2], uint32_t width, uint32_t height) {
 	struct pool_buffer *buffer = NULL;
@@ -111,15 +169,8 @@ struct pool_buffer *get_next_buffer(struct wl_shm *shm,
 		return NULL;
 	}
 
-	if (buffer->width != width || buffer->height != height) {
-		destroy_buffer(buffer);
-	}
-
-	if (!buffer->buffer) {
-		if (!create_buffer(shm, buffer, width, height,
-					WL_SHM_FORMAT_ARGB8888)) {
-			return NULL;
-		}
+	if (!reuse_buffer(shm, buffer, width, height)) {
+		return NULL;
 	}
 	buffer->busy = true;
 	return buffer;
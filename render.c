@@ -1,38 +1,50 @@
 #include <math.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <wayland-client.h>
 #include "cairo.h"
 #include "background-image.h"
 #include "swaylock.h"
 #include "log.h"
+#include "loop.h"
+#include "probe.h"
+#include "trace.h"
+#include "viewporter-client-protocol.h"
 
 #define M_PI 3.14159265358979323846
 const float TYPE_INDICATOR_RANGE = M_PI / 3.0f;
 
-static void set_color_for_state(cairo_t *cairo, struct swaylock_state *state,
+static uint32_t get_color_for_state(struct swaylock_state *state,
 		struct swaylock_colorset *colorset) {
 	if (state->input_state == INPUT_STATE_CLEAR) {
-		cairo_set_source_u32(cairo, colorset->cleared);
+		return colorset->cleared;
 	} else if (state->auth_state == AUTH_STATE_VALIDATING) {
-		cairo_set_source_u32(cairo, colorset->verifying);
+		return colorset->verifying;
 	} else if (state->auth_state == AUTH_STATE_INVALID) {
-		cairo_set_source_u32(cairo, colorset->wrong);
-	} else {
-		if (state->xkb.caps_lock && state->args.show_caps_lock_indicator) {
-			cairo_set_source_u32(cairo, colorset->caps_lock);
-		} else if (state->xkb.caps_lock && !state->args.show_caps_lock_indicator &&
-				state->args.show_caps_lock_text) {
-			uint32_t inputtextcolor = state->args.colors.text.input;
-			state->args.colors.text.input = state->args.colors.text.caps_lock;
-			cairo_set_source_u32(cairo, colorset->input);
-			state->args.colors.text.input = inputtextcolor;
-		} else {
-			cairo_set_source_u32(cairo, colorset->input);
-		}
+		return colorset->wrong;
+	} else if (state->xkb.caps_lock && state->args.show_caps_lock_indicator) {
+		return colorset->caps_lock;
+	} else if (state->xkb.caps_lock && state->args.show_caps_lock_text &&
+			colorset == &state->args.colors.text) {
+		// Only the text shows that Caps Lock is on
+		return colorset->caps_lock;
+	}
+	return colorset->input;
+}
+
+static uint32_t get_highlight_color(struct swaylock_state *state) {
+	bool caps_lock = state->xkb.caps_lock && state->args.show_caps_lock_indicator;
+	if (state->input_state == INPUT_STATE_LETTER) {
+		return caps_lock ? state->args.colors.caps_lock_key_highlight :
+			state->args.colors.key_highlight;
 	}
+	return caps_lock ? state->args.colors.caps_lock_bs_highlight :
+		state->args.colors.bs_highlight;
 }
 
+static void schedule_prerender(struct swaylock_surface *surface);
+
 static void surface_frame_handle_done(void *data, struct wl_callback *callback,
 		uint32_t time) {
 	struct swaylock_surface *surface = data;
@@ -41,14 +53,162 @@ static void surface_frame_handle_done(void *data, struct wl_callback *callback,
 	surface->frame = NULL;
 
 	render(surface);
+	schedule_prerender(surface);
 }
 
 static const struct wl_callback_listener surface_frame_listener = {
 	.done = surface_frame_handle_done,
 };
 
+static void child_frame_handle_done(void *data, struct wl_callback *callback,
+		uint32_t time) {
+	struct swaylock_surface *surface = data;
+
+	wl_callback_destroy(callback);
+	surface->child_frame = NULL;
+
+	render(surface);
+	schedule_prerender(surface);
+}
+
+static const struct wl_callback_listener child_frame_listener = {
+	.done = child_frame_handle_done,
+};
+
 static bool render_frame(struct swaylock_surface *surface);
 
+void render_background(cairo_t *cairo, struct swaylock_state *state,
+		cairo_surface_t *image, int buffer_width, int buffer_height) {
+	cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
+
+	cairo_save(cairo);
+	cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
+	cairo_set_source_u32(cairo, state->args.colors.background);
+	cairo_paint(cairo);
+	if (image && state->args.mode != BACKGROUND_MODE_SOLID_COLOR) {
+		cairo_set_operator(cairo, CAIRO_OPERATOR_OVER);
+		render_background_image(cairo, image,
+			state->args.mode, buffer_width, buffer_height);
+	}
+	cairo_restore(cairo);
+	cairo_identity_matrix(cairo);
+}
+
+bool surface_is_opaque(struct swaylock_surface *surface) {
+	struct swaylock_state *state = surface->state;
+	if ((state->args.colors.background & 0xff) == 0xff) {
+		// Any image is drawn over the background color
+		return true;
+	}
+	return surface->image &&
+		cairo_surface_get_content(surface->image) == CAIRO_CONTENT_COLOR &&
+		state->args.mode != BACKGROUND_MODE_SOLID_COLOR &&
+		state->args.mode != BACKGROUND_MODE_CENTER &&
+		state->args.mode != BACKGROUND_MODE_FIT;
+}
+
+static uint32_t get_background_format(struct swaylock_state *state,
+		bool opaque) {
+	if (!opaque) {
+		return WL_SHM_FORMAT_ARGB8888;
+	}
+	// Without an alpha channel, the compositor does not need to blend the
+	// background with what is below it
+	if (state->args.low_memory &&
+			shm_format_supported(WL_SHM_FORMAT_RGB565)) {
+		return WL_SHM_FORMAT_RGB565;
+	}
+	return WL_SHM_FORMAT_XRGB8888;
+}
+
+static void render_image(struct swaylock_surface *surface,
+		int buffer_width, int buffer_height) {
+	struct swaylock_state *state = surface->state;
+	int scale = surface->scale;
+
+	int x, y, width, height;
+	bool exact = get_background_image_box(surface->image, state->args.mode,
+		buffer_width, buffer_height, &x, &y, &width, &height);
+	if (width == 0 || height == 0) {
+		wl_surface_attach(surface->image_surface, NULL, 0, 0);
+		wl_surface_commit(surface->image_surface);
+		return;
+	}
+
+	// The subsurface must start and end on whole surface coordinates, so the
+	// buffer may include some of the background color around the image
+	int x0 = x / scale * scale;
+	int y0 = y / scale * scale;
+	int x1 = (x + width + scale - 1) / scale * scale;
+	int y1 = (y + height + scale - 1) / scale * scale;
+
+	bool color_opaque = (state->args.colors.background & 0xff) == 0xff;
+	bool image_opaque =
+		cairo_surface_get_content(surface->image) == CAIRO_CONTENT_COLOR;
+	// Unless the image covers exactly the whole buffer, its edges show the
+	// background color, alone or blended with the image
+	bool covered = exact && x0 == x && y0 == y &&
+		x1 == x + width && y1 == y + height;
+
+	struct pool_buffer buffer;
+	if (!create_buffer(state->shm, &buffer, x1 - x0, y1 - y0,
+			get_background_format(state, color_opaque || (image_opaque && covered)))) {
+		swaylock_log(LOG_ERROR, "Failed to create new buffer for image.");
+		return;
+	}
+	// Draw the same pixels as on a buffer covering the whole surface
+	cairo_translate(buffer.cairo, -x0, -y0);
+	render_background(buffer.cairo, state, surface->image,
+		buffer_width, buffer_height);
+
+	struct wl_region *region = wl_compositor_create_region(state->compositor);
+	if (color_opaque) {
+		wl_region_add(region, 0, 0, (x1 - x0) / scale, (y1 - y0) / scale);
+	} else if (image_opaque) {
+		// The edges of an image which does not cover whole pixels are
+		// partially transparent
+		int inset = exact ? 0 : 1;
+		int inner_x0 = (x + inset + scale - 1) / scale;
+		int inner_y0 = (y + inset + scale - 1) / scale;
+		int inner_x1 = (x + width - inset) / scale;
+		int inner_y1 = (y + height - inset) / scale;
+		if (inner_x1 > inner_x0 && inner_y1 > inner_y0) {
+			wl_region_add(region, inner_x0 - x0 / scale, inner_y0 - y0 / scale,
+				inner_x1 - inner_x0, inner_y1 - inner_y0);
+		}
+	}
+	wl_surface_set_opaque_region(surface->image_surface, region);
+	wl_region_destroy(region);
+
+	// Both are applied when the background surface is committed
+	wl_subsurface_set_position(surface->image_subsurface, x0 / scale, y0 / scale);
+	wl_surface_set_buffer_scale(surface->image_surface, scale);
+	wl_surface_attach(surface->image_surface, buffer.buffer, 0, 0);
+	wl_surface_damage_buffer(surface->image_surface, 0, 0, INT32_MAX, INT32_MAX);
+	wl_surface_commit(surface->image_surface);
+
+	destroy_buffer(&buffer);
+}
+
+// The levels of the images are only needed until each output has drawn its
+// background
+static void release_image_levels(struct swaylock_state *state) {
+	struct swaylock_surface *surface;
+	wl_list_for_each(surface, &state->surfaces, link) {
+		int buffer_width = surface->width * surface->scale;
+		int buffer_height = surface->height * surface->scale;
+		if (buffer_width == 0 || buffer_height == 0 ||
+				surface->last_buffer_width != buffer_width ||
+				surface->last_buffer_height != buffer_height) {
+			return;
+		}
+	}
+	struct swaylock_image *image;
+	wl_list_for_each(image, &state->images, link) {
+		release_background_image_levels(image->cairo_surface);
+	}
+}
+
 void render(struct swaylock_surface *surface) {
 	struct swaylock_state *state = surface->state;
 
@@ -58,49 +218,82 @@ void render(struct swaylock_surface *surface) {
 		return; // not yet configured
 	}
 
-	if (!surface->dirty || surface->frame) {
-		// Nothing to do or frame already pending
+	if (!surface->dirty) {
 		return;
 	}
 
+	// Once desynchronized, the indicator is committed on its own unless the
+	// background has to be redrawn too
+	bool update_background = surface->child_sync ||
+		buffer_width != surface->last_buffer_width ||
+		buffer_height != surface->last_buffer_height ||
+		surface->scale != surface->last_buffer_scale;
+	if (update_background ? surface->frame != NULL : surface->child_frame != NULL) {
+		// Frame already pending
+		return;
+	}
+
+	SWAYLOCK_PROBE(render_start, buffer_width, buffer_height);
+	trace_begin("render");
+
+	if (!update_background) {
+		render_frame(surface);
+		surface->dirty = false;
+		trace_end("render");
+		SWAYLOCK_PROBE(render_end, buffer_width, buffer_height);
+		return;
+	}
+
+	// The indicator is drawn over the new background, so both must be
+	// presented together
+	if (!surface->child_sync) {
+		wl_subsurface_set_sync(surface->layers[INDICATOR_LAYER_RING].subsurface);
+		surface->child_sync = true;
+	}
+
 	bool need_destroy = false;
 	struct pool_buffer buffer;
 
 	if (buffer_width != surface->last_buffer_width ||
-			buffer_height != surface->last_buffer_height) {
+			buffer_height != surface->last_buffer_height ||
+			surface->scale != surface->last_buffer_scale) {
+		// With a viewport, a single pixel of the background color is enough
+		int width = surface->viewport ? 1 : buffer_width;
+		int height = surface->viewport ? 1 : buffer_height;
 		need_destroy = true;
-		if (!create_buffer(state->shm, &buffer, buffer_width, buffer_height,
-				WL_SHM_FORMAT_ARGB8888)) {
+		if (!create_buffer(state->shm, &buffer, width, height,
+				get_background_format(state, surface_is_opaque(surface)))) {
 			swaylock_log(LOG_ERROR,
 				"Failed to create new buffer for frame background.");
+			trace_end("render");
+			SWAYLOCK_PROBE(render_end, buffer_width, buffer_height);
 			return;
 		}
 
-		cairo_t *cairo = buffer.cairo;
-		cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
-
-		cairo_save(cairo);
-		cairo_set_operator(cairo, CAIRO_OPERATOR_SOURCE);
-		cairo_set_source_u32(cairo, state->args.colors.background);
-		cairo_paint(cairo);
-		if (surface->image && state->args.mode != BACKGROUND_MODE_SOLID_COLOR) {
-			cairo_set_operator(cairo, CAIRO_OPERATOR_OVER);
-			render_background_image(cairo, surface->image,
-				state->args.mode, buffer_width, buffer_height);
-		}
-		cairo_restore(cairo);
-		cairo_identity_matrix(cairo);
+		// An image in its own subsurface is not drawn on the background
+		render_background(buffer.cairo, state,
+			surface->image_surface ? NULL : surface->image, width, height);
 
+		if (surface->viewport) {
+			wp_viewport_set_destination(surface->viewport,
+				surface->width, surface->height);
+		}
 		wl_surface_attach(surface->surface, buffer.buffer, 0, 0);
 		wl_surface_damage_buffer(surface->surface, 0, 0, INT32_MAX, INT32_MAX);
 		need_destroy = true;
 
+		if (surface->image_surface) {
+			render_image(surface, buffer_width, buffer_height);
+		}
+
 		surface->last_buffer_width = buffer_width;
 		surface->last_buffer_height = buffer_height;
+		release_image_levels(state);
 	}
 
 	// It is possible for the surface scale to change even if the wl_buffer size hasn't
-	wl_surface_set_buffer_scale(surface->surface, surface->scale);
+	wl_surface_set_buffer_scale(surface->surface, surface->viewport ? 1 : surface->scale);
+	surface->last_buffer_scale = surface->scale;
 
 	render_frame(surface);
 	surface->dirty = false;
@@ -108,9 +301,17 @@ void render(struct swaylock_surface *surface) {
 	wl_callback_add_listener(surface->frame, &surface_frame_listener, surface);
 	wl_surface_commit(surface->surface);
 
+	// Further indicator updates do not need the full-screen surface to be
+	// committed again
+	wl_subsurface_set_desync(surface->layers[INDICATOR_LAYER_RING].subsurface);
+	surface->child_sync = false;
+
 	if (need_destroy) {
 		destroy_buffer(&buffer);
 	}
+
+	trace_end("render");
+	SWAYLOCK_PROBE(render_end, buffer_width, buffer_height);
 }
 
 static void configure_font_drawing(cairo_t *cairo, struct swaylock_state *state,
@@ -131,17 +332,209 @@ static void configure_font_drawing(cairo_t *cairo, struct swaylock_state *state,
 	cairo_font_options_destroy(fo);
 }
 
-static bool render_frame(struct swaylock_surface *surface) {
+static void render_ring(cairo_t *cairo, struct swaylock_state *state,
+		const struct swaylock_indicator_content *content,
+		int buffer_width, int buffer_diameter) {
+	int arc_radius = state->args.radius * content->scale;
+	int arc_thickness = state->args.thickness * content->scale;
+
+	// Fill inner circle
+	cairo_set_line_width(cairo, 0);
+	cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
+			arc_radius - arc_thickness / 2, 0, 2 * M_PI);
+	cairo_set_source_u32(cairo, content->inside);
+	cairo_fill_preserve(cairo);
+	cairo_stroke(cairo);
+
+	// Draw ring
+	cairo_set_line_width(cairo, arc_thickness);
+	cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2, arc_radius,
+			0, 2 * M_PI);
+	cairo_set_source_u32(cairo, content->ring);
+	cairo_stroke(cairo);
+
+	// Draw inner + outer border of the circle
+	cairo_set_source_u32(cairo, content->line);
+	cairo_set_line_width(cairo, 2.0 * content->scale);
+	cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
+			arc_radius - arc_thickness / 2, 0, 2 * M_PI);
+	cairo_stroke(cairo);
+	cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
+			arc_radius + arc_thickness / 2, 0, 2 * M_PI);
+	cairo_stroke(cairo);
+}
+
+static void render_text(cairo_t *cairo, struct swaylock_state *state,
+		const struct swaylock_indicator_content *content,
+		enum wl_output_subpixel subpixel, int buffer_width, int buffer_diameter) {
+	int scale = content->scale;
+	int arc_radius = state->args.radius * scale;
+
+	// Draw a message
+	configure_font_drawing(cairo, state, subpixel, arc_radius);
+	cairo_set_source_u32(cairo, content->text_color);
+
+	if (content->text) {
+		cairo_text_extents_t extents;
+		cairo_font_extents_t fe;
+		double x, y;
+		cairo_text_extents(cairo, content->text, &extents);
+		cairo_font_extents(cairo, &fe);
+		x = (buffer_width / 2) -
+			(extents.width / 2 + extents.x_bearing);
+		y = (buffer_diameter / 2) +
+			(fe.height / 2 - fe.descent);
+
+		cairo_move_to(cairo, x, y);
+		cairo_show_text(cairo, content->text);
+		cairo_close_path(cairo);
+		cairo_new_sub_path(cairo);
+	}
+
+	// display layout text separately
+	if (content->layout_text) {
+		cairo_text_extents_t extents;
+		cairo_font_extents_t fe;
+		double x, y;
+		double box_padding = 4.0 * scale;
+		cairo_set_line_width(cairo, 2.0 * scale);
+		cairo_text_extents(cairo, content->layout_text, &extents);
+		cairo_font_extents(cairo, &fe);
+		// upper left coordinates for box
+		x = (buffer_width / 2) - (extents.width / 2) - box_padding;
+		y = buffer_diameter;
+
+		// background box
+		cairo_rectangle(cairo, x, y,
+			extents.width + 2.0 * box_padding,
+			fe.height + 2.0 * box_padding);
+		cairo_set_source_u32(cairo, state->args.colors.layout_background);
+		cairo_fill_preserve(cairo);
+		// border
+		cairo_set_source_u32(cairo, state->args.colors.layout_border);
+		cairo_stroke(cairo);
+
+		// take font extents and padding into account
+		cairo_move_to(cairo,
+			x - extents.x_bearing + box_padding,
+			y + (fe.height - fe.descent) + box_padding);
+		cairo_set_source_u32(cairo, state->args.colors.layout_text);
+		cairo_show_text(cairo, content->layout_text);
+		cairo_new_sub_path(cairo);
+	}
+}
+
+// Typing indicator: Highlight random part on keypress
+static void render_highlight(cairo_t *cairo, struct swaylock_state *state,
+		const struct swaylock_indicator_content *content,
+		int buffer_width, int buffer_diameter) {
+	if (!content->highlight) {
+		return;
+	}
+
+	int scale = content->scale;
+	int arc_radius = state->args.radius * scale;
+	int arc_thickness = state->args.thickness * scale;
+
+	double highlight_start = content->highlight_start * (M_PI / 1024.0);
+	cairo_set_line_width(cairo, arc_thickness);
+	cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
+			arc_radius, highlight_start,
+			highlight_start + TYPE_INDICATOR_RANGE);
+	cairo_set_source_u32(cairo, content->highlight_color);
+	cairo_stroke(cairo);
+
+	// Draw borders
+	double inner_radius = buffer_diameter / 2.0 - arc_thickness * 1.5;
+	double outer_radius = buffer_diameter / 2.0 - arc_thickness / 2.0;
+
+	cairo_set_line_width(cairo, 2.0 * scale);
+	cairo_set_source_u32(cairo, state->args.colors.separator);
+	cairo_move_to(cairo,
+		buffer_width / 2.0 + cos(highlight_start) * inner_radius,
+		buffer_diameter / 2.0 + sin(highlight_start) * inner_radius
+	);
+	cairo_line_to(cairo,
+		buffer_width / 2.0 + cos(highlight_start) * outer_radius,
+		buffer_diameter / 2.0 + sin(highlight_start) * outer_radius
+	);
+	cairo_stroke(cairo);
+
+	cairo_move_to(cairo,
+		buffer_width / 2.0 + cos(highlight_start + TYPE_INDICATOR_RANGE) * inner_radius,
+		buffer_diameter / 2.0 + sin(highlight_start + TYPE_INDICATOR_RANGE) * inner_radius
+	);
+	cairo_line_to(cairo,
+		buffer_width / 2.0 + cos(highlight_start + TYPE_INDICATOR_RANGE) * outer_radius,
+		buffer_diameter / 2.0 + sin(highlight_start + TYPE_INDICATOR_RANGE) * outer_radius
+	);
+	cairo_stroke(cairo);
+
+	// The borders of the ring are drawn over the highlight
+	cairo_set_source_u32(cairo, content->line);
+	cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
+			arc_radius - arc_thickness / 2, highlight_start,
+			highlight_start + TYPE_INDICATOR_RANGE);
+	cairo_stroke(cairo);
+	cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
+			arc_radius + arc_thickness / 2, highlight_start,
+			highlight_start + TYPE_INDICATOR_RANGE);
+	cairo_stroke(cairo);
+}
+
+static bool same_text(const char *a, const char *b) {
+	return a == b || (a && b && strcmp(a, b) == 0);
+}
+
+static void free_indicator_content(struct swaylock_indicator_content *content) {
+	free(content->text);
+	free(content->layout_text);
+	content->text = NULL;
+	content->layout_text = NULL;
+}
+
+// Whether a layer looks the same for both contents
+static bool same_layer_content(enum indicator_layer layer,
+		const struct swaylock_indicator_content *a,
+		const struct swaylock_indicator_content *b) {
+	if (a->visible != b->visible || a->width != b->width ||
+			a->height != b->height || a->scale != b->scale) {
+		return false;
+	}
+	switch (layer) {
+	case INDICATOR_LAYER_RING:
+		return a->inside == b->inside && a->ring == b->ring &&
+			a->line == b->line;
+	case INDICATOR_LAYER_TEXT:
+		return a->text_color == b->text_color &&
+			same_text(a->text, b->text) &&
+			same_text(a->layout_text, b->layout_text);
+	case INDICATOR_LAYER_HIGHLIGHT:
+		return a->highlight == b->highlight &&
+			a->highlight_color == b->highlight_color &&
+			a->highlight_start == b->highlight_start &&
+			a->line == b->line;
+	case INDICATOR_LAYER_COUNT:
+		break;
+	}
+	abort();
+}
+
+// Computes what the indicator shows in the current state, and its position
+static void get_indicator_content(struct swaylock_surface *surface,
+		struct swaylock_indicator_content *content, int *xpos, int *ypos) {
 	struct swaylock_state *state = surface->state;
 
 	// First, compute the text that will be drawn, if any, since this
 	// determines the size/positioning of the surface
 
 	char attempts[4]; // like i3lock: count no more than 999
+	char backoff[16];
 	char *text = NULL;
 	const char *layout_text = NULL;
 
 	bool draw_indicator = state->args.show_indicator &&
+		surface_shows_indicator(surface) &&
 		(state->auth_state != AUTH_STATE_IDLE ||
 			state->input_state != INPUT_STATE_IDLE ||
 			state->args.indicator_idle_visible);
@@ -151,7 +544,12 @@ static bool render_frame(struct swaylock_surface *surface) {
 			// This message has highest priority
 			text = "Cleared";
 		} else if (state->auth_state == AUTH_STATE_VALIDATING) {
-			text = "Verifying";
+			text = state->password_queued ? "Queued" : "Verifying";
+		} else if (state->auth_state == AUTH_STATE_INVALID &&
+				state->backoff_remaining > 0) {
+			snprintf(backoff, sizeof(backoff), "Wait %ds",
+				state->backoff_remaining);
+			text = backoff;
 		} else if (state->auth_state == AUTH_STATE_INVALID) {
 			text = "Wrong";
 		} else {
@@ -241,15 +639,114 @@ static bool render_frame(struct swaylock_surface *surface) {
 			(state->args.radius + state->args.thickness);
 	}
 
-	struct pool_buffer *buffer = get_next_buffer(state->shm,
-			surface->indicator_buffers, buffer_width, buffer_height);
-	if (buffer == NULL) {
-		swaylock_log(LOG_ERROR, "No buffer");
-		return false;
+	*content = (struct swaylock_indicator_content){
+		.visible = draw_indicator,
+		.width = buffer_width,
+		.height = buffer_height,
+		.scale = surface->scale,
+	};
+	if (draw_indicator) {
+		content->inside = get_color_for_state(state, &state->args.colors.inside);
+		content->ring = get_color_for_state(state, &state->args.colors.ring);
+		content->line = get_color_for_state(state, &state->args.colors.line);
+		content->text_color = get_color_for_state(state, &state->args.colors.text);
+		content->text = text ? strdup(text) : NULL;
+		content->layout_text = layout_text ? strdup(layout_text) : NULL;
+		content->highlight = state->input_state == INPUT_STATE_LETTER ||
+			state->input_state == INPUT_STATE_BACKSPACE;
+		if (content->highlight) {
+			content->highlight_color = get_highlight_color(state);
+			content->highlight_start = state->highlight_start;
+		}
+	}
+	*xpos = subsurf_xpos;
+	*ypos = subsurf_ypos;
+}
+
+/**
+ * Computes the part of the indicator which a layer buffer covers, in buffer
+ * pixels. The ring and text layers cover all of it, while the highlight only
+ * covers the bounding box of its arc, rounded outwards to whole surface
+ * coordinates, so that a keystroke only draws and commits a small buffer.
+ */
+static void get_layer_box(struct swaylock_state *state,
+		enum indicator_layer layer,
+		const struct swaylock_indicator_content *content,
+		int *x, int *y, int *width, int *height) {
+	int scale = content->scale;
+	if (layer != INDICATOR_LAYER_HIGHLIGHT) {
+		*x = *y = 0;
+		*width = content->width;
+		*height = content->height;
+		return;
+	}
+	if (!content->visible || !content->highlight) {
+		// A single transparent surface pixel
+		*x = *y = 0;
+		*width = *height = scale;
+		return;
+	}
+
+	int arc_radius = state->args.radius * scale;
+	int arc_thickness = state->args.thickness * scale;
+	int buffer_diameter = (arc_radius + arc_thickness) * 2;
+	double cx = content->width / 2, cy = buffer_diameter / 2;
+	// The borders are 2 * scale wide, and centered on the edges of the arc
+	double inner = arc_radius - arc_thickness / 2 - scale;
+	double outer = arc_radius + arc_thickness / 2 + scale;
+	double start = content->highlight_start * (M_PI / 1024.0);
+	double end = start + TYPE_INDICATOR_RANGE;
+
+	double x0 = cx + cos(start) * inner, x1 = x0;
+	double y0 = cy + sin(start) * inner, y1 = y0;
+	double points[][2] = {
+		{ start, outer },
+		{ end, inner },
+		{ end, outer },
+		{ 0, 0 },
+	};
+	size_t len = 3;
+	// The arc reaches further where it crosses an axis, which it does at
+	// most once since it is shorter than a quarter turn
+	for (int k = 1; k <= 5; ++k) {
+		double angle = k * M_PI / 2;
+		if (angle > start && angle < end) {
+			points[len][0] = angle;
+			points[len][1] = outer;
+			++len;
+			break;
+		}
+	}
+	for (size_t i = 0; i < len; ++i) {
+		double px = cx + cos(points[i][0]) * points[i][1];
+		double py = cy + sin(points[i][0]) * points[i][1];
+		x0 = fmin(x0, px);
+		x1 = fmax(x1, px);
+		y0 = fmin(y0, py);
+		y1 = fmax(y1, py);
 	}
 
+	// The separators at both ends are 2 * scale wide too, and one more pixel
+	// is left for antialiasing
+	int margin = scale + 1;
+	int left = fmax(floor(x0) - margin, 0);
+	int top = fmax(floor(y0) - margin, 0);
+	int right = fmin(ceil(x1) + margin, content->width);
+	int bottom = fmin(ceil(y1) + margin, content->height);
+	*x = left / scale * scale;
+	*y = top / scale * scale;
+	*width = (right + scale - 1) / scale * scale - *x;
+	*height = (bottom + scale - 1) / scale * scale - *y;
+}
+
+static void draw_layer(struct swaylock_surface *surface,
+		enum indicator_layer layer, cairo_t *cairo,
+		const struct swaylock_indicator_content *content) {
+	struct swaylock_state *state = surface->state;
+	int buffer_diameter =
+		(state->args.radius + state->args.thickness) * content->scale * 2;
+
 	// Render the buffer
-	cairo_t *cairo = buffer->cairo;
 	cairo_set_antialias(cairo, CAIRO_ANTIALIAS_BEST);
 
 	cairo_identity_matrix(cairo);
@@ -261,141 +758,236 @@ static bool render_frame(struct swaylock_surface *surface) {
 	cairo_paint(cairo);
 	cairo_restore(cairo);
 
-	if (draw_indicator) {
-		// Fill inner circle
-		cairo_set_line_width(cairo, 0);
-		cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
-				arc_radius - arc_thickness / 2, 0, 2 * M_PI);
-		set_color_for_state(cairo, state, &state->args.colors.inside);
-		cairo_fill_preserve(cairo);
-		cairo_stroke(cairo);
+	if (!content->visible) {
+		return;
+	}
+	int x, y, width, height;
+	get_layer_box(state, layer, content, &x, &y, &width, &height);
+	cairo_translate(cairo, -x, -y);
+	switch (layer) {
+	case INDICATOR_LAYER_RING:
+		render_ring(cairo, state, content, content->width, buffer_diameter);
+		break;
+	case INDICATOR_LAYER_TEXT:
+		render_text(cairo, state, content, surface->subpixel,
+			content->width, buffer_diameter);
+		break;
+	case INDICATOR_LAYER_HIGHLIGHT:
+		render_highlight(cairo, state, content, content->width, buffer_diameter);
+		break;
+	case INDICATOR_LAYER_COUNT:
+		abort();
+	}
+}
 
-		// Draw ring
-		cairo_set_line_width(cairo, arc_thickness);
-		cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2, arc_radius,
-				0, 2 * M_PI);
-		set_color_for_state(cairo, state, &state->args.colors.ring);
-		cairo_stroke(cairo);
+/**
+ * Returns the index of a buffer of the layer which holds the content, drawing
+ * it into the least recently used free buffer if there is none. The buffers in
+ * the keep mask are not drawn into. Returns -1 if no buffer is available.
+ */
+static int get_layer_buffer(struct swaylock_surface *surface,
+		enum indicator_layer index,
+		const struct swaylock_indicator_content *content, unsigned keep) {
+	static uint64_t uses = 0;
+	struct swaylock_indicator_layer *layer = &surface->layers[index];
+
+	int found = -1;
+	for (int i = 0; i < INDICATOR_LAYER_BUFFERS; ++i) {
+		struct pool_buffer *buffer = &layer->buffers[i];
+		if (buffer->buffer && (!buffer->busy || buffer == layer->shown) &&
+				same_layer_content(index, &layer->drawn[i], content)) {
+			layer->last_used[i] = ++uses;
+			return i;
+		}
+		if (buffer->busy || buffer == layer->shown || (keep & (1u << i))) {
+			continue;
+		}
+		if (found == -1 || layer->last_used[i] < layer->last_used[found]) {
+			found = i;
+		}
+	}
+	if (found == -1) {
+		return -1;
+	}
 
-		// Draw a message
-		configure_font_drawing(cairo, state, surface->subpixel, arc_radius);
-		set_color_for_state(cairo, state, &state->args.colors.text);
+	struct swaylock_indicator_content *drawn = &layer->drawn[found];
+	free_indicator_content(drawn);
+	*drawn = (struct swaylock_indicator_content){0};
+	int x, y, width, height;
+	get_layer_box(surface->state, index, content, &x, &y, &width, &height);
+	if (!reuse_buffer(surface->state->shm, &layer->buffers[found],
+			width, height)) {
+		return -1;
+	}
+	draw_layer(surface, index, layer->buffers[found].cairo, content);
 
-		if (text) {
-			cairo_text_extents_t extents;
-			cairo_font_extents_t fe;
-			double x, y;
-			cairo_text_extents(cairo, text, &extents);
-			cairo_font_extents(cairo, &fe);
-			x = (buffer_width / 2) -
-				(extents.width / 2 + extents.x_bearing);
-			y = (buffer_diameter / 2) +
-				(fe.height / 2 - fe.descent);
-
-			cairo_move_to(cairo, x, y);
-			cairo_show_text(cairo, text);
-			cairo_close_path(cairo);
-			cairo_new_sub_path(cairo);
+	*drawn = *content;
+	drawn->text = content->text ? strdup(content->text) : NULL;
+	drawn->layout_text = content->layout_text ? strdup(content->layout_text) : NULL;
+	layer->last_used[found] = ++uses;
+	return found;
+}
+
+void render_indicator_layers(struct swaylock_surface *surface,
+		cairo_surface_t *layers[static INDICATOR_LAYER_COUNT]) {
+	struct swaylock_indicator_content content;
+	int xpos, ypos;
+	get_indicator_content(surface, &content, &xpos, &ypos);
+	for (int i = 0; i < INDICATOR_LAYER_COUNT; ++i) {
+		int x, y, width, height;
+		get_layer_box(surface->state, i, &content, &x, &y, &width, &height);
+		if (layers[i] && (cairo_image_surface_get_width(layers[i]) != width ||
+				cairo_image_surface_get_height(layers[i]) != height)) {
+			cairo_surface_destroy(layers[i]);
+			layers[i] = NULL;
+		}
+		if (!layers[i]) {
+			layers[i] = cairo_image_surface_create(CAIRO_FORMAT_ARGB32,
+				width, height);
 		}
+		cairo_t *cairo = cairo_create(layers[i]);
+		draw_layer(surface, i, cairo, &content);
+		cairo_destroy(cairo);
+		cairo_surface_flush(layers[i]);
+	}
+	free_indicator_content(&content);
+}
 
-		// Typing indicator: Highlight random part on keypress
-		if (state->input_state == INPUT_STATE_LETTER ||
-				state->input_state == INPUT_STATE_BACKSPACE) {
-			double highlight_start = state->highlight_start * (M_PI / 1024.0);
-			cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
-					arc_radius, highlight_start,
-					highlight_start + TYPE_INDICATOR_RANGE);
-			if (state->input_state == INPUT_STATE_LETTER) {
-				if (state->xkb.caps_lock && state->args.show_caps_lock_indicator) {
-					cairo_set_source_u32(cairo, state->args.colors.caps_lock_key_highlight);
-				} else {
-					cairo_set_source_u32(cairo, state->args.colors.key_highlight);
-				}
-			} else {
-				if (state->xkb.caps_lock && state->args.show_caps_lock_indicator) {
-					cairo_set_source_u32(cairo, state->args.colors.caps_lock_bs_highlight);
-				} else {
-					cairo_set_source_u32(cairo, state->args.colors.bs_highlight);
-				}
+static bool render_frame(struct swaylock_surface *surface) {
+	SWAYLOCK_PROBE(render_frame_start);
+	trace_begin("render_frame");
+
+	struct swaylock_indicator_content content;
+	int subsurf_xpos, subsurf_ypos;
+	get_indicator_content(surface, &content, &subsurf_xpos, &subsurf_ypos);
+
+	// Only the layers whose content changed need another buffer, which may
+	// have been drawn ahead of time
+	int buffers[INDICATOR_LAYER_COUNT];
+	for (int i = 0; i < INDICATOR_LAYER_COUNT; ++i) {
+		buffers[i] = get_layer_buffer(surface, i, &content, 0);
+		if (buffers[i] == -1) {
+			swaylock_log(LOG_ERROR, "No buffer");
+			free_indicator_content(&content);
+			trace_end("render_frame");
+			SWAYLOCK_PROBE(render_frame_end, 0, 0);
+			return false;
+		}
+	}
+
+	// Send Wayland requests. The text and highlight layers are synchronized
+	// children of the ring layer, so that all layers change together when
+	// the ring layer is committed, last.
+	bool changed = false;
+	for (int i = INDICATOR_LAYER_COUNT - 1; i >= 0; --i) {
+		struct swaylock_indicator_layer *layer = &surface->layers[i];
+		struct pool_buffer *buffer = &layer->buffers[buffers[i]];
+		if (buffer == layer->shown) {
+			continue;
+		}
+		if (i != INDICATOR_LAYER_RING) {
+			// Applied with the commit of the ring layer, its parent
+			int x, y, width, height;
+			get_layer_box(surface->state, i, &content, &x, &y, &width, &height);
+			if (x / surface->scale != layer->x || y / surface->scale != layer->y) {
+				layer->x = x / surface->scale;
+				layer->y = y / surface->scale;
+				wl_subsurface_set_position(layer->subsurface, layer->x, layer->y);
 			}
-			cairo_stroke(cairo);
-
-			// Draw borders
-			double inner_radius = buffer_diameter / 2.0 - arc_thickness * 1.5;
-			double outer_radius = buffer_diameter / 2.0 - arc_thickness / 2.0;
-
-			cairo_set_line_width(cairo, 2.0 * surface->scale);
-			cairo_set_source_u32(cairo, state->args.colors.separator);
-			cairo_move_to(cairo,
-				buffer_width / 2.0 + cos(highlight_start) * inner_radius,
-				buffer_diameter / 2.0 + sin(highlight_start) * inner_radius
-			);
-			cairo_line_to(cairo,
-				buffer_width / 2.0 + cos(highlight_start) * outer_radius,
-				buffer_diameter / 2.0 + sin(highlight_start) * outer_radius
-			);
-			cairo_stroke(cairo);
-
-			cairo_move_to(cairo,
-				buffer_width / 2.0 + cos(highlight_start + TYPE_INDICATOR_RANGE) * inner_radius,
-				buffer_diameter / 2.0 + sin(highlight_start + TYPE_INDICATOR_RANGE) * inner_radius
-			);
-			cairo_line_to(cairo,
-				buffer_width / 2.0 + cos(highlight_start + TYPE_INDICATOR_RANGE) * outer_radius,
-				buffer_diameter / 2.0 + sin(highlight_start + TYPE_INDICATOR_RANGE) * outer_radius
-			);
-			cairo_stroke(cairo);
 		}
+		wl_surface_set_buffer_scale(layer->surface, surface->scale);
+		wl_surface_attach(layer->surface, buffer->buffer, 0, 0);
+		wl_surface_damage_buffer(layer->surface, 0, 0, INT32_MAX, INT32_MAX);
+		if (i != INDICATOR_LAYER_RING) {
+			wl_surface_commit(layer->surface);
+		}
+		buffer->busy = true;
+		layer->shown = buffer;
+		changed = true;
+	}
 
-		// Draw inner + outer border of the circle
-		set_color_for_state(cairo, state, &state->args.colors.line);
-		cairo_set_line_width(cairo, 2.0 * surface->scale);
-		cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
-				arc_radius - arc_thickness / 2, 0, 2 * M_PI);
-		cairo_stroke(cairo);
-		cairo_arc(cairo, buffer_width / 2, buffer_diameter / 2,
-				arc_radius + arc_thickness / 2, 0, 2 * M_PI);
-		cairo_stroke(cairo);
+	struct swaylock_indicator_layer *ring = &surface->layers[INDICATOR_LAYER_RING];
+	bool moved = subsurf_xpos != surface->child_x || subsurf_ypos != surface->child_y;
+	if (changed || moved) {
+		if (surface->child_frame == NULL) {
+			surface->child_frame = wl_surface_frame(ring->surface);
+			wl_callback_add_listener(surface->child_frame, &child_frame_listener, surface);
+		}
+		// The position of the ring layer is state of the background surface,
+		// so the ring layer is synchronized to be shown with it
+		if (moved && !surface->child_sync) {
+			wl_subsurface_set_sync(ring->subsurface);
+		}
+		wl_surface_commit(ring->surface);
+	}
+	if (moved) {
+		wl_subsurface_set_position(ring->subsurface, subsurf_xpos, subsurf_ypos);
+		surface->child_x = subsurf_xpos;
+		surface->child_y = subsurf_ypos;
+		if (!surface->child_sync) {
+			wl_surface_commit(surface->surface);
+			wl_subsurface_set_desync(ring->subsurface);
+		}
+	}
 
-		// display layout text separately
-		if (layout_text) {
-			cairo_text_extents_t extents;
-			cairo_font_extents_t fe;
-			double x, y;
-			double box_padding = 4.0 * surface->scale;
-			cairo_text_extents(cairo, layout_text, &extents);
-			cairo_font_extents(cairo, &fe);
-			// upper left coordinates for box
-			x = (buffer_width / 2) - (extents.width / 2) - box_padding;
-			y = buffer_diameter;
-
-			// background box
-			cairo_rectangle(cairo, x, y,
-				extents.width + 2.0 * box_padding,
-				fe.height + 2.0 * box_padding);
-			cairo_set_source_u32(cairo, state->args.colors.layout_background);
-			cairo_fill_preserve(cairo);
-			// border
-			cairo_set_source_u32(cairo, state->args.colors.layout_border);
-			cairo_stroke(cairo);
-
-			// take font extents and padding into account
-			cairo_move_to(cairo,
-				x - extents.x_bearing + box_padding,
-				y + (fe.height - fe.descent) + box_padding);
-			cairo_set_source_u32(cairo, state->args.colors.layout_text);
-			cairo_show_text(cairo, layout_text);
-			cairo_new_sub_path(cairo);
+	trace_end("render_frame");
+	SWAYLOCK_PROBE(render_frame_end, content.width, content.height);
+	free_indicator_content(&content);
+	return true;
+}
+
+static void prerender_indicator(void *data) {
+	struct swaylock_surface *surface = data;
+	struct swaylock_state *state = surface->state;
+	surface->prerender_timer = NULL;
+
+	if (surface->dirty || surface->child_sync) {
+		// The next frame is drawn anyway
+		return;
+	}
+	if (!surface_shows_indicator(surface)) {
+		return;
+	}
+
+	trace_begin("prerender");
+
+	// The inputs most likely to come next, by decreasing likelihood. The
+	// state is only changed temporarily, to compute what it would look like.
+	static const enum input_state inputs[] = {
+		INPUT_STATE_LETTER,
+		INPUT_STATE_BACKSPACE,
+		INPUT_STATE_CLEAR,
+	};
+	enum input_state input_state = state->input_state;
+	uint32_t highlight_start = state->highlight_start;
+	state->highlight_start = state->next_highlight_start;
+
+	unsigned keep[INDICATOR_LAYER_COUNT] = {0};
+	for (size_t i = 0; i < sizeof(inputs) / sizeof(inputs[0]); ++i) {
+		state->input_state = inputs[i];
+		struct swaylock_indicator_content content;
+		int xpos, ypos;
+		get_indicator_content(surface, &content, &xpos, &ypos);
+		for (int j = 0; j < INDICATOR_LAYER_COUNT; ++j) {
+			int buffer = get_layer_buffer(surface, j, &content, keep[j]);
+			if (buffer != -1) {
+				keep[j] |= 1u << buffer;
+			}
 		}
+		free_indicator_content(&content);
 	}
 
-	// Send Wayland requests
-	wl_subsurface_set_position(surface->subsurface, subsurf_xpos, subsurf_ypos);
+	state->input_state = input_state;
+	state->highlight_start = highlight_start;
 
-	wl_surface_set_buffer_scale(surface->child, surface->scale);
-	wl_surface_attach(surface->child, buffer->buffer, 0, 0);
-	wl_surface_damage_buffer(surface->child, 0, 0, INT32_MAX, INT32_MAX);
-	wl_surface_commit(surface->child);
+	trace_end("prerender");
+}
 
-	return true;
+static void schedule_prerender(struct swaylock_surface *surface) {
+	if (surface->dirty || surface->prerender_timer) {
+		return;
+	}
+	// Run once the pending events are handled
+	surface->prerender_timer = loop_add_timer(surface->state->eventloop, 0,
+		prerender_indicator, surface);
 }
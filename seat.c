@@ -1,12 +1,71 @@
 #include <assert.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/mman.h>
+#include <time.h>
 #include <unistd.h>
 #include <xkbcommon/xkbcommon.h>
 #include "log.h"
 #include "swaylock.h"
 #include "seat.h"
 #include "loop.h"
+#include "probe.h"
+#include "trace.h"
+
+static uint64_t hash_keymap(const char *text, size_t size) {
+	// FNV-1a
+	uint64_t hash = 0xcbf29ce484222325;
+	for (size_t i = 0; i < size; ++i) {
+		hash ^= (unsigned char)text[i];
+		hash *= 0x100000001b3;
+	}
+	return hash;
+}
+
+static struct xkb_keymap *get_keymap(struct swaylock_xkb *xkb,
+		const char *text, size_t size) {
+	uint64_t hash = hash_keymap(text, size);
+	struct swaylock_keymap_cache_entry *lru = &xkb->keymap_cache[0];
+	for (size_t i = 0; i < KEYMAP_CACHE_SIZE; ++i) {
+		struct swaylock_keymap_cache_entry *entry = &xkb->keymap_cache[i];
+		// The text is compared too, since a keymap compiled from another
+		// text would make the password be typed differently
+		if (entry->keymap && entry->hash == hash && entry->size == size &&
+				memcmp(entry->text, text, size) == 0) {
+			entry->last_used = ++xkb->keymap_cache_clock;
+			return xkb_keymap_ref(entry->keymap);
+		}
+		if (entry->last_used < lru->last_used) {
+			lru = entry;
+		}
+	}
+
+	trace_begin("keymap_compile");
+	struct xkb_keymap *keymap = xkb_keymap_new_from_buffer(
+		xkb->context, text, size, XKB_KEYMAP_FORMAT_TEXT_V1,
+		XKB_KEYMAP_COMPILE_NO_FLAGS);
+	trace_end("keymap_compile");
+	if (!keymap) {
+		return NULL;
+	}
+
+	char *copy = malloc(size);
+	if (!copy) {
+		// Not cached
+		return keymap;
+	}
+	memcpy(copy, text, size);
+	xkb_keymap_unref(lru->keymap);
+	free(lru->text);
+	*lru = (struct swaylock_keymap_cache_entry){
+		.hash = hash,
+		.size = size,
+		.text = copy,
+		.last_used = ++xkb->keymap_cache_clock,
+		.keymap = xkb_keymap_ref(keymap),
+	};
+	return keymap;
+}
 
 static void keyboard_keymap(void *data, struct wl_keyboard *wl_keyboard,
 		uint32_t format, int32_t fd, uint32_t size) {
@@ -26,9 +85,7 @@ static void keyboard_keymap(void *data, struct wl_keyboard *wl_keyboard,
 			swaylock_log(LOG_ERROR, "Unable to initialize keymap shm, aborting");
 			exit(1);
 		}
-		keymap = xkb_keymap_new_from_buffer(
-			state->xkb.context, map_shm, size - 1, XKB_KEYMAP_FORMAT_TEXT_V1,
-			XKB_KEYMAP_COMPILE_NO_FLAGS);
+		keymap = get_keymap(&state->xkb, map_shm, size - 1);
 		assert(keymap);
 		munmap(map_shm, size - 1);
 
@@ -47,7 +104,8 @@ static void keyboard_keymap(void *data, struct wl_keyboard *wl_keyboard,
 
 static void keyboard_enter(void *data, struct wl_keyboard *wl_keyboard,
 		uint32_t serial, struct wl_surface *surface, struct wl_array *keys) {
-	// Who cares
+	struct swaylock_seat *seat = data;
+	focus_surface(seat->state, surface);
 }
 
 static void keyboard_leave(void *data, struct wl_keyboard *wl_keyboard,
@@ -55,11 +113,36 @@ static void keyboard_leave(void *data, struct wl_keyboard *wl_keyboard,
 	// Who cares
 }
 
+static uint64_t get_time_ns(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static void keyboard_repeat(void *data);
+
+static void schedule_repeat(struct swaylock_seat *seat, uint64_t now) {
+	// Rounded up, so that the timer never fires before the deadline
+	uint64_t delay = seat->repeat_deadline - now;
+	int ms = (delay + 999999) / 1000000;
+	seat->repeat_timer = loop_add_timer(
+		seat->state->eventloop, ms, keyboard_repeat, seat);
+}
+
 static void keyboard_repeat(void *data) {
 	struct swaylock_seat *seat = data;
 	struct swaylock_state *state = seat->state;
-	seat->repeat_timer = loop_add_timer(
-		state->eventloop, seat->repeat_period_ms, keyboard_repeat, seat);
+
+	// Deadlines are absolute, so that the time taken to dispatch and handle
+	// each repeat does not slow repeating down. Repeats missed entirely are
+	// dropped rather than caught up with.
+	uint64_t now = get_time_ns();
+	seat->repeat_deadline += seat->repeat_period_ns;
+	if (seat->repeat_deadline <= now) {
+		seat->repeat_deadline = now + seat->repeat_period_ns;
+	}
+	schedule_repeat(seat, now);
+
 	swaylock_handle_key(state, seat->repeat_sym, seat->repeat_codepoint);
 }
 
@@ -77,6 +160,8 @@ static void keyboard_key(void *data, struct wl_keyboard *wl_keyboard,
 		key + 8 : 0;
 	uint32_t codepoint = xkb_state_key_get_utf32(state->xkb.state, keycode);
 	if (key_state == WL_KEYBOARD_KEY_STATE_PRESSED) {
+		trace_instant("key_press");
+		SWAYLOCK_PROBE(key_press, time);
 		swaylock_handle_key(state, sym, codepoint);
 	}
 
@@ -85,11 +170,12 @@ static void keyboard_key(void *data, struct wl_keyboard *wl_keyboard,
 		seat->repeat_timer = NULL;
 	}
 
-	if (key_state == WL_KEYBOARD_KEY_STATE_PRESSED && seat->repeat_period_ms > 0) {
+	if (key_state == WL_KEYBOARD_KEY_STATE_PRESSED && seat->repeat_period_ns > 0) {
 		seat->repeat_sym = sym;
 		seat->repeat_codepoint = codepoint;
-		seat->repeat_timer = loop_add_timer(
-			seat->state->eventloop, seat->repeat_delay_ms, keyboard_repeat, seat);
+		uint64_t now = get_time_ns();
+		seat->repeat_deadline = now + (uint64_t)seat->repeat_delay_ms * 1000000;
+		schedule_repeat(seat, now);
 	}
 }
 
@@ -121,10 +207,10 @@ static void keyboard_repeat_info(void *data, struct wl_keyboard *wl_keyboard,
 		int32_t rate, int32_t delay) {
 	struct swaylock_seat *seat = data;
 	if (rate <= 0) {
-		seat->repeat_period_ms = -1;
+		seat->repeat_period_ns = -1;
 	} else {
-		// Keys per second -> milliseconds between keys
-		seat->repeat_period_ms = 1000 / rate;
+		// Keys per second -> nanoseconds between keys
+		seat->repeat_period_ns = 1000000000 / rate;
 	}
 	seat->repeat_delay_ms = delay;
 }
@@ -141,7 +227,9 @@ static const struct wl_keyboard_listener keyboard_listener = {
 static void wl_pointer_enter(void *data, struct wl_pointer *wl_pointer,
 		uint32_t serial, struct wl_surface *surface,
 		wl_fixed_t surface_x, wl_fixed_t surface_y) {
+	struct swaylock_seat *seat = data;
 	wl_pointer_set_cursor(wl_pointer, serial, NULL, 0, 0);
+	focus_surface(seat->state, surface);
 }
 
 static void wl_pointer_leave(void *data, struct wl_pointer *wl_pointer,
@@ -208,7 +296,7 @@ static void seat_handle_capabilities(void *data, struct wl_seat *wl_seat,
 	}
 	if ((caps & WL_SEAT_CAPABILITY_POINTER)) {
 		seat->pointer = wl_seat_get_pointer(wl_seat);
-		wl_pointer_add_listener(seat->pointer, &pointer_listener, NULL);
+		wl_pointer_add_listener(seat->pointer, &pointer_listener, seat);
 	}
 	if ((caps & WL_SEAT_CAPABILITY_KEYBOARD)) {
 		seat->keyboard = wl_seat_get_keyboard(wl_seat);
@@ -13,8 +13,8 @@
 #endif
 #include "comm.h"
 #include "log.h"
-#include "password-buffer.h"
 #include "swaylock.h"
+#include "trace.h"
 
 char *encpw = NULL;
 
@@ -64,16 +64,23 @@ void initialize_pw_backend(int argc, char **argv) {
 void run_pw_backend_child(void) {
 	assert(encpw != NULL);
 	while (1) {
+		uint32_t id;
 		char *buf;
-		ssize_t size = read_comm_request(&buf);
+		ssize_t size = read_comm_request(&id, &buf);
 		if (size < 0) {
 			exit(EXIT_FAILURE);
 		} else if (size == 0) {
 			break;
 		}
 
+		trace_begin("authenticate");
+		uint64_t start = get_comm_time();
 		const char *c = crypt(buf, encpw);
-		password_buffer_destroy(buf, size);
+		struct comm_timing timing = {
+			.auth = get_comm_time() - start,
+		};
+		trace_end("authenticate");
+		release_comm_request(buf, size);
 		buf = NULL;
 
 		if (c == NULL) {
@@ -82,13 +89,19 @@ void run_pw_backend_child(void) {
 		}
 		bool success = strcmp(c, encpw) == 0;
 
-		if (!write_comm_reply(success)) {
+		if (!write_comm_reply(id,
+				success ? COMM_RESULT_SUCCESS : COMM_RESULT_FAILURE,
+				&timing)) {
 			exit(EXIT_FAILURE);
 		}
-
-		sleep(2);
 	}
 
 	clear_buffer(encpw, strlen(encpw));
 	exit(EXIT_SUCCESS);
 }
+
+struct comm_channel *spawn_immediate_pam_child(const char *service) {
+	swaylock_log(LOG_ERROR, "Cannot authenticate with PAM service %s: "
+		"swaylock was compiled with the shadow backend", service);
+	return NULL;
+}
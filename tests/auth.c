@@ -0,0 +1,228 @@
+/*
+ * Drives the password checking child through comm.c, with pam.c or shadow.c
+ * linked against the stand-ins of fake-auth.h, and checks that:
+ *
+ * - each request gets a single result with its ID and the right outcome,
+ *   after its status messages;
+ * - a request written while another one is checked, which then goes over the
+ *   socket rather than the shared region, is answered in turn;
+ * - a password submitted while another one is checked is queued by
+ *   password.c, and only sent once the first one failed.
+ *
+ * It also measures the round trip of failing requests, and prints the median
+ * of it and of the overhead of comm.c over the time the child spent checking,
+ * in microseconds, as a line of JSON.
+ *
+ * Usage: auth [requests]
+ */
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "comm.h"
+#include "config.h"
+#include "fake-auth.h"
+#include "log.h"
+#include "loop.h"
+#include "password-buffer.h"
+#include "swaylock.h"
+
+static const char *correct = "correct horse";
+
+#if HAVE_PAM
+#define BACKEND "pam"
+// The fake module sends one message per check
+#define MESSAGES 1
+#else
+#define BACKEND "shadow"
+#define MESSAGES 0
+#endif
+
+static struct swaylock_state state;
+
+void damage_state(struct swaylock_state *state) {
+	// Nothing is drawn
+}
+
+static int compare_times(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static uint32_t submit(const char *password) {
+	struct swaylock_password pw = {
+		.len = strlen(password),
+		.buffer_len = COMM_PASSWORD_MAX,
+		.buffer = password_buffer_create(COMM_PASSWORD_MAX),
+	};
+	if (!pw.buffer) {
+		fprintf(stderr, "Failed to allocate a password buffer\n");
+		exit(EXIT_FAILURE);
+	}
+	memcpy(pw.buffer, password, pw.len + 1);
+	uint32_t id = write_comm_request(&pw);
+	if (id == 0 || pw.len != 0 || pw.buffer[0] != '\0') {
+		fprintf(stderr, "Failed to write a request, or the password was "
+			"not cleared\n");
+		exit(EXIT_FAILURE);
+	}
+	password_buffer_destroy(pw.buffer, pw.buffer_len);
+	return id;
+}
+
+// Reads the messages about the request up to its result
+static void expect_result(uint32_t id, enum comm_result expected,
+		struct comm_reply *reply) {
+	int messages = 0;
+	while (true) {
+		if (!read_comm_reply(get_comm_reply_fd(), reply)) {
+			fprintf(stderr, "The password checking child exited\n");
+			exit(EXIT_FAILURE);
+		}
+		if (reply->id != id) {
+			fprintf(stderr, "Expected a reply to request %u, got one to %u\n",
+				id, reply->id);
+			exit(EXIT_FAILURE);
+		}
+		if (reply->final) {
+			break;
+		}
+		++messages;
+	}
+	if (reply->result != expected) {
+		fprintf(stderr, "Request %u %s, expected it to %s\n", id,
+			reply->result == COMM_RESULT_SUCCESS ? "succeeded" : "failed",
+			expected == COMM_RESULT_SUCCESS ? "succeed" : "fail");
+		exit(EXIT_FAILURE);
+	}
+	if (messages != MESSAGES) {
+		fprintf(stderr, "Expected %d messages before the result of "
+			"request %u, got %d\n", MESSAGES, id, messages);
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void test_concurrent(void) {
+	struct comm_reply reply;
+	uint32_t first = submit("wrong");
+	uint32_t second = submit("also wrong");
+	expect_result(first, COMM_RESULT_FAILURE, &reply);
+	expect_result(second, COMM_RESULT_FAILURE, &reply);
+	// The shared region is available again
+	uint32_t third = submit("still wrong");
+	expect_result(third, COMM_RESULT_FAILURE, &reply);
+}
+
+static void bench_round_trip(int requests) {
+	uint64_t *round_trips = calloc(requests, sizeof(uint64_t));
+	uint64_t *overheads = calloc(requests, sizeof(uint64_t));
+	if (!round_trips || !overheads) {
+		fprintf(stderr, "Allocation failed\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < requests; ++i) {
+		struct comm_reply reply;
+		uint64_t start = get_comm_time();
+		uint32_t id = submit("wrong");
+		expect_result(id, COMM_RESULT_FAILURE, &reply);
+		round_trips[i] = get_comm_time() - start;
+		overheads[i] = round_trips[i] - reply.timing.auth - reply.timing.delay;
+	}
+	qsort(round_trips, requests, sizeof(uint64_t), compare_times);
+	qsort(overheads, requests, sizeof(uint64_t), compare_times);
+	printf("{\"backend\":\"%s\",\"requests\":%d,\"round_trip_us\":%llu,"
+		"\"overhead_us\":%llu}\n", BACKEND, requests,
+		(unsigned long long)round_trips[requests / 2],
+		(unsigned long long)overheads[requests / 2]);
+	free(round_trips);
+	free(overheads);
+}
+
+static void type(const char *text) {
+	for (const char *c = text; *c; ++c) {
+		// Printable ASCII characters are their own keysyms
+		swaylock_handle_key(&state, *c, *c);
+	}
+}
+
+// Last, since a successful check ends the PAM child
+static void test_queued(void) {
+	struct comm_reply reply;
+	type("wrong");
+	swaylock_handle_key(&state, XKB_KEY_Return, 0);
+	uint32_t first = state.auth_request;
+	if (state.auth_state != AUTH_STATE_VALIDATING || first == 0) {
+		fprintf(stderr, "The password was not submitted\n");
+		exit(EXIT_FAILURE);
+	}
+
+	type(correct);
+	swaylock_handle_key(&state, XKB_KEY_Return, 0);
+	if (!state.password_queued || state.auth_request != first ||
+			state.password.len != 0) {
+		fprintf(stderr, "The second password was not queued\n");
+		exit(EXIT_FAILURE);
+	}
+
+	// As swaylock does with the result
+	expect_result(first, COMM_RESULT_FAILURE, &reply);
+	++state.failed_attempts;
+	handle_auth_failure(&state);
+	if (state.password_queued || state.auth_request == first ||
+			state.auth_state != AUTH_STATE_VALIDATING) {
+		fprintf(stderr, "The queued password was not sent\n");
+		exit(EXIT_FAILURE);
+	}
+	expect_result(state.auth_request, COMM_RESULT_SUCCESS, &reply);
+}
+
+static bool init_password(struct swaylock_password *pw) {
+	pw->len = 0;
+	pw->buffer_len = 256;
+	pw->buffer = password_buffer_create(pw->buffer_len);
+	if (!pw->buffer) {
+		return false;
+	}
+	pw->buffer[0] = 0;
+	return true;
+}
+
+int main(int argc, char **argv) {
+	int requests = argc > 1 ? atoi(argv[1]) : 100;
+	if (argc > 2 || requests <= 0) {
+		fprintf(stderr, "Usage: %s [requests]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	// The failures are expected
+	swaylock_log_init(LOG_SILENT);
+	const struct fake_auth config = {
+		.password = correct,
+		.latency_ms = 1,
+		.fail_delay_ms = 1,
+		.message = "Checking",
+		.setting = "$6$swaylock$",
+	};
+	if (!fake_auth_setup(&config) || !spawn_comm_child() ||
+			!password_buffer_init()) {
+		return EXIT_FAILURE;
+	}
+
+	state.args.backoff = BACKOFF_MODE_NONE;
+	state.eventloop = loop_create();
+	if (!init_password(&state.password) ||
+			!init_password(&state.queued_password)) {
+		fprintf(stderr, "Failed to allocate the password buffers\n");
+		return EXIT_FAILURE;
+	}
+
+	test_concurrent();
+	bench_round_trip(requests);
+	test_queued();
+
+	password_buffer_destroy(state.password.buffer, state.password.buffer_len);
+	password_buffer_destroy(state.queued_password.buffer,
+		state.queued_password.buffer_len);
+	loop_destroy(state.eventloop);
+	return EXIT_SUCCESS;
+}
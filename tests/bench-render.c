@@ -0,0 +1,311 @@
+/*
+ * Measures drawing the background and the indicator into image surfaces, as
+ * swaylock does into its buffers, without a compositor.
+ *
+ * Usage: bench-render [min-time-ms]
+ *
+ * Each case runs at least 3 times and for at least min-time-ms (200 by
+ * default), and is printed as a line of JSON, e.g.
+ *
+ *   {"bench":"background","mode":"fill","image":"3840x2160",
+ *    "buffer":"1920x1080","runs":12,"ns":16843210}
+ *   {"bench":"indicator","auth":"validating","input":"letter","scale":2,
+ *    "runs":4211,"ns":47312}
+ *   {"bench":"scale","path":"integer","mode":"fill","image":"1920x1080",
+ *    "buffer":"3840x2160","runs":52,"ns":3912004}
+ *
+ * where ns is the median time of a run, so that results can be compared
+ * between builds. The scale cases draw images whose size is an integer ratio
+ * of the buffer with the integer path and with cairo's filters.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include "background-image.h"
+#include "cairo.h"
+#include "offscreen.h"
+#include "swaylock.h"
+
+#define MIN_RUNS 3
+#define MAX_RUNS 4096
+
+struct size {
+	int width, height;
+};
+
+static uint64_t min_time = 200 * 1000000ull;
+static uint64_t run_times[MAX_RUNS];
+
+static int compare_times(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+// Runs the case until it took long enough, and returns the median time of a
+// run
+static uint64_t measure(void (*run)(void *data), void *data, int *runs) {
+	uint64_t total = 0;
+	int n = 0;
+	while (n < MAX_RUNS && (n < MIN_RUNS || total < min_time)) {
+		uint64_t start = offscreen_time();
+		run(data);
+		run_times[n] = offscreen_time() - start;
+		total += run_times[n++];
+	}
+	qsort(run_times, n, sizeof(run_times[0]), compare_times);
+	*runs = n;
+	return run_times[n / 2];
+}
+
+// An opaque image with details at every scale, as decoded from a photo
+static cairo_surface_t *create_image(struct size size) {
+	cairo_surface_t *image = cairo_image_surface_create(CAIRO_FORMAT_RGB24,
+		size.width, size.height);
+	if (cairo_surface_status(image) != CAIRO_STATUS_SUCCESS) {
+		fprintf(stderr, "Failed to create %dx%d image\n",
+			size.width, size.height);
+		exit(EXIT_FAILURE);
+	}
+	cairo_surface_flush(image);
+	unsigned char *data = cairo_image_surface_get_data(image);
+	int stride = cairo_image_surface_get_stride(image);
+	uint32_t noise = 1;
+	for (int y = 0; y < size.height; ++y) {
+		uint32_t *row = (uint32_t *)(data + (size_t)y * stride);
+		for (int x = 0; x < size.width; ++x) {
+			noise = noise * 1664525 + 1013904223;
+			uint32_t r = x * 255 / size.width;
+			uint32_t g = y * 255 / size.height;
+			uint32_t b = (noise >> 24) & 0x3f;
+			row[x] = 0xff000000 | r << 16 | g << 8 | b;
+		}
+	}
+	cairo_surface_mark_dirty(image);
+	return image;
+}
+
+struct background_case {
+	struct swaylock_state *state;
+	cairo_surface_t *image;
+	cairo_t *cairo;
+	struct size buffer;
+};
+
+static void run_background(void *data) {
+	struct background_case *c = data;
+	render_background(c->cairo, c->state, c->image,
+		c->buffer.width, c->buffer.height);
+	cairo_surface_flush(cairo_get_target(c->cairo));
+	// As once all outputs are drawn, so that each run builds them again
+	release_background_image_levels(c->image);
+}
+
+static void bench_background(struct swaylock_state *state) {
+	static const struct {
+		enum background_mode mode;
+		const char *name;
+	} modes[] = {
+		{ BACKGROUND_MODE_STRETCH, "stretch" },
+		{ BACKGROUND_MODE_FILL, "fill" },
+		{ BACKGROUND_MODE_FIT, "fit" },
+		{ BACKGROUND_MODE_CENTER, "center" },
+		{ BACKGROUND_MODE_TILE, "tile" },
+	};
+	static const struct size images[] = {
+		{ 1366, 768 },
+		{ 1920, 1080 },
+		{ 3840, 2160 },
+		{ 7680, 4320 },
+	};
+	// From 1080p at scale 1 to 8K at scale 3 and more
+	static const struct size buffers[] = {
+		{ 1920, 1080 },
+		{ 2560, 1440 },
+		{ 3840, 2160 },
+		{ 5760, 3240 },
+		{ 7680, 4320 },
+	};
+
+	for (size_t i = 0; i < sizeof(images) / sizeof(images[0]); ++i) {
+		cairo_surface_t *image = create_image(images[i]);
+		for (size_t j = 0; j < sizeof(buffers) / sizeof(buffers[0]); ++j) {
+			cairo_surface_t *target = cairo_image_surface_create(
+				CAIRO_FORMAT_RGB24, buffers[j].width, buffers[j].height);
+			cairo_t *cairo = cairo_create(target);
+			for (size_t k = 0; k < sizeof(modes) / sizeof(modes[0]); ++k) {
+				state->args.mode = modes[k].mode;
+				struct background_case c = {
+					.state = state,
+					.image = image,
+					.cairo = cairo,
+					.buffer = buffers[j],
+				};
+				int runs;
+				uint64_t ns = measure(run_background, &c, &runs);
+				printf("{\"bench\":\"background\",\"mode\":\"%s\","
+					"\"image\":\"%dx%d\",\"buffer\":\"%dx%d\","
+					"\"runs\":%d,\"ns\":%llu}\n",
+					modes[k].name, images[i].width, images[i].height,
+					buffers[j].width, buffers[j].height,
+					runs, (unsigned long long)ns);
+				fflush(stdout);
+			}
+			cairo_destroy(cairo);
+			cairo_surface_destroy(target);
+		}
+		cairo_surface_destroy(image);
+	}
+}
+
+struct scale_case {
+	cairo_surface_t *image;
+	cairo_t *cairo;
+	enum background_mode mode;
+	struct size buffer;
+	bool cairo_only;
+};
+
+static void run_scale(void *data) {
+	struct scale_case *c = data;
+	if (c->cairo_only) {
+		render_background_image_cairo(c->cairo, c->image, c->mode,
+			c->buffer.width, c->buffer.height);
+	} else {
+		render_background_image(c->cairo, c->image, c->mode,
+			c->buffer.width, c->buffer.height);
+	}
+	cairo_surface_flush(cairo_get_target(c->cairo));
+}
+
+// Compares the integer ratio paths with cairo's filters for the same sizes
+static void bench_scale(void) {
+	static const struct {
+		struct size image, buffer;
+	} ratios[] = {
+		{ { 1920, 1080 }, { 3840, 2160 } },
+		{ { 1920, 1080 }, { 5760, 3240 } },
+		{ { 3840, 2160 }, { 7680, 4320 } },
+		{ { 3840, 2160 }, { 1920, 1080 } },
+		{ { 7680, 4320 }, { 3840, 2160 } },
+		{ { 7680, 4320 }, { 1920, 1080 } },
+	};
+	static const struct {
+		enum background_mode mode;
+		const char *name;
+	} modes[] = {
+		{ BACKGROUND_MODE_FILL, "fill" },
+		// Fit, with the image scaled to the height of a wider buffer
+		{ BACKGROUND_MODE_FIT, "fit" },
+	};
+
+	for (size_t i = 0; i < sizeof(ratios) / sizeof(ratios[0]); ++i) {
+		cairo_surface_t *image = create_image(ratios[i].image);
+		for (size_t j = 0; j < sizeof(modes) / sizeof(modes[0]); ++j) {
+			struct size buffer = ratios[i].buffer;
+			if (modes[j].mode == BACKGROUND_MODE_FIT) {
+				buffer.width = buffer.width * 4 / 3;
+			}
+			cairo_surface_t *target = cairo_image_surface_create(
+				CAIRO_FORMAT_RGB24, buffer.width, buffer.height);
+			cairo_t *cairo = cairo_create(target);
+			for (int k = 0; k < 2; ++k) {
+				struct scale_case c = {
+					.image = image,
+					.cairo = cairo,
+					.mode = modes[j].mode,
+					.buffer = buffer,
+					.cairo_only = k == 1,
+				};
+				int runs;
+				uint64_t ns = measure(run_scale, &c, &runs);
+				printf("{\"bench\":\"scale\",\"path\":\"%s\","
+					"\"mode\":\"%s\",\"image\":\"%dx%d\","
+					"\"buffer\":\"%dx%d\",\"runs\":%d,\"ns\":%llu}\n",
+					c.cairo_only ? "cairo" : "integer", modes[j].name,
+					ratios[i].image.width, ratios[i].image.height,
+					buffer.width, buffer.height, runs, (unsigned long long)ns);
+				fflush(stdout);
+			}
+			cairo_destroy(cairo);
+			cairo_surface_destroy(target);
+		}
+		cairo_surface_destroy(image);
+	}
+}
+
+struct indicator_case {
+	struct swaylock_surface *surface;
+	cairo_surface_t *layers[INDICATOR_LAYER_COUNT];
+};
+
+static void run_indicator(void *data) {
+	struct indicator_case *c = data;
+	render_indicator_layers(c->surface, c->layers);
+}
+
+static void bench_indicator(struct swaylock_state *state) {
+	static const struct {
+		enum auth_state state;
+		const char *name;
+	} auth_states[] = {
+		{ AUTH_STATE_IDLE, "idle" },
+		{ AUTH_STATE_VALIDATING, "validating" },
+		{ AUTH_STATE_INVALID, "invalid" },
+	};
+	static const struct {
+		enum input_state state;
+		const char *name;
+	} input_states[] = {
+		{ INPUT_STATE_IDLE, "idle" },
+		{ INPUT_STATE_CLEAR, "clear" },
+		{ INPUT_STATE_LETTER, "letter" },
+		{ INPUT_STATE_BACKSPACE, "backspace" },
+		{ INPUT_STATE_NEUTRAL, "neutral" },
+	};
+
+	// Otherwise, nothing is drawn in the idle states
+	state->args.indicator_idle_visible = true;
+	for (int32_t scale = 1; scale <= 3; ++scale) {
+		struct swaylock_surface surface;
+		offscreen_init_surface(&surface, state, 1920, 1080, scale);
+		for (size_t i = 0; i < sizeof(auth_states) / sizeof(auth_states[0]); ++i) {
+			for (size_t j = 0; j < sizeof(input_states) / sizeof(input_states[0]); ++j) {
+				state->auth_state = auth_states[i].state;
+				state->input_state = input_states[j].state;
+				struct indicator_case c = { .surface = &surface };
+				int runs;
+				uint64_t ns = measure(run_indicator, &c, &runs);
+				printf("{\"bench\":\"indicator\",\"auth\":\"%s\","
+					"\"input\":\"%s\",\"scale\":%d,\"runs\":%d,\"ns\":%llu}\n",
+					auth_states[i].name, input_states[j].name, scale,
+					runs, (unsigned long long)ns);
+				fflush(stdout);
+				for (int k = 0; k < INDICATOR_LAYER_COUNT; ++k) {
+					cairo_surface_destroy(c.layers[k]);
+				}
+			}
+		}
+		wl_list_remove(&surface.link);
+	}
+	state->args.indicator_idle_visible = false;
+	state->auth_state = AUTH_STATE_IDLE;
+	state->input_state = INPUT_STATE_IDLE;
+}
+
+int main(int argc, char **argv) {
+	if (argc > 2) {
+		fprintf(stderr, "Usage: %s [min-time-ms]\n", argv[0]);
+		return EXIT_FAILURE;
+	} else if (argc == 2) {
+		min_time = strtoull(argv[1], NULL, 10) * 1000000;
+	}
+
+	struct swaylock_state state;
+	offscreen_init_state(&state);
+	bench_indicator(&state);
+	bench_background(&state);
+	bench_scale();
+	offscreen_finish_state(&state);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,29 @@
+#ifndef _SWAYLOCK_TESTS_FAKE_AUTH_H
+#define _SWAYLOCK_TESTS_FAKE_AUTH_H
+#include <stdbool.h>
+
+/*
+ * Stand-ins for the system's authentication, which pam.c or shadow.c are
+ * linked with instead of libpam or the user's shadow entry, so that the
+ * password checking child runs without root or any system configuration.
+ */
+
+struct fake_auth {
+	const char *password; // the only one which is accepted
+	// PAM only: time taken by each check, delay requested after a failure,
+	// and message sent during each check, if not NULL
+	unsigned int latency_ms;
+	unsigned int fail_delay_ms;
+	const char *message;
+	// Shadow only: crypt() setting which the hash is made with, and which
+	// determines its cost, e.g. "$6$rounds=5000$swaylock$"
+	const char *setting;
+};
+
+// Must be called before the password checking child is spawned. Otherwise,
+// the PAM stand-in reads its configuration from FAKE_AUTH_PASSWORD,
+// FAKE_AUTH_LATENCY_MS and FAKE_AUTH_FAIL_DELAY_MS, so that it can be linked
+// into swaylock itself.
+bool fake_auth_setup(const struct fake_auth *config);
+
+#endif
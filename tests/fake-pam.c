@@ -0,0 +1,133 @@
+#include <errno.h>
+#include <security/pam_appl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "fake-auth.h"
+#include "swaylock.h"
+
+/*
+ * The part of the PAM API which pam.c uses, with a single module accepting
+ * the configured password.
+ */
+
+struct pam_handle {
+	struct pam_conv conv;
+	void (*fail_delay)(int status, unsigned int usec, void *data);
+};
+
+static struct fake_auth config;
+
+bool fake_auth_setup(const struct fake_auth *fake) {
+	config = *fake;
+	return true;
+}
+
+static void sleep_ms(unsigned int ms) {
+	struct timespec delay = {
+		.tv_sec = ms / 1000,
+		.tv_nsec = (ms % 1000) * 1000000,
+	};
+	while (nanosleep(&delay, &delay) != 0 && errno == EINTR);
+}
+
+static void free_responses(struct pam_response *resp, int num_resp) {
+	if (!resp) {
+		return;
+	}
+	for (int i = 0; i < num_resp; ++i) {
+		if (resp[i].resp) {
+			clear_buffer(resp[i].resp, strlen(resp[i].resp));
+			free(resp[i].resp);
+		}
+	}
+	free(resp);
+}
+
+static int converse(pam_handle_t *handle, int style, const char *text,
+		struct pam_response **resp) {
+	const struct pam_message message = {
+		.msg_style = style,
+		.msg = text,
+	};
+	const struct pam_message *messages[] = { &message };
+	*resp = NULL;
+	return handle->conv.conv(1, messages, resp, handle->conv.appdata_ptr);
+}
+
+// Without fake_auth_setup(), as when linked into swaylock itself
+static void setup_from_environment(void) {
+	config.password = getenv("FAKE_AUTH_PASSWORD");
+	const char *latency = getenv("FAKE_AUTH_LATENCY_MS");
+	config.latency_ms = latency ? strtoul(latency, NULL, 10) : 0;
+	const char *fail_delay = getenv("FAKE_AUTH_FAIL_DELAY_MS");
+	config.fail_delay_ms = fail_delay ? strtoul(fail_delay, NULL, 10) : 0;
+}
+
+int pam_start(const char *service, const char *user,
+		const struct pam_conv *conv, pam_handle_t **handle) {
+	if (!config.password) {
+		setup_from_environment();
+		if (!config.password) {
+			return PAM_SYSTEM_ERR;
+		}
+	}
+	*handle = calloc(1, sizeof(**handle));
+	if (!*handle) {
+		return PAM_BUF_ERR;
+	}
+	(*handle)->conv = *conv;
+	return PAM_SUCCESS;
+}
+
+// Used instead when built with the pam-confdir option
+int pam_start_confdir(const char *service, const char *user,
+		const struct pam_conv *conv, const char *confdir,
+		pam_handle_t **handle) {
+	return pam_start(service, user, conv, handle);
+}
+
+int pam_set_item(pam_handle_t *handle, int type, const void *item) {
+#ifdef PAM_FAIL_DELAY
+	if (type == PAM_FAIL_DELAY) {
+		handle->fail_delay =
+			(void (*)(int status, unsigned int usec, void *data))item;
+	}
+#endif
+	return PAM_SUCCESS;
+}
+
+int pam_authenticate(pam_handle_t *handle, int flags) {
+	struct pam_response *resp;
+	if (config.message) {
+		int status = converse(handle, PAM_TEXT_INFO, config.message, &resp);
+		free_responses(resp, 1);
+		if (status != PAM_SUCCESS) {
+			return status;
+		}
+	}
+
+	int status = converse(handle, PAM_PROMPT_ECHO_OFF, "Password: ", &resp);
+	bool success = status == PAM_SUCCESS && resp && resp[0].resp &&
+		strcmp(resp[0].resp, config.password) == 0;
+	free_responses(resp, 1);
+	sleep_ms(config.latency_ms);
+	if (status != PAM_SUCCESS) {
+		return status;
+	}
+
+	if (!success && handle->fail_delay && config.fail_delay_ms) {
+		handle->fail_delay(PAM_AUTH_ERR, config.fail_delay_ms * 1000,
+			handle->conv.appdata_ptr);
+	}
+	return success ? PAM_SUCCESS : PAM_AUTH_ERR;
+}
+
+int pam_setcred(pam_handle_t *handle, int flags) {
+	return PAM_SUCCESS;
+}
+
+int pam_end(pam_handle_t *handle, int status) {
+	free(handle);
+	return PAM_SUCCESS;
+}
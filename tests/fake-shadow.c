@@ -0,0 +1,24 @@
+#undef _POSIX_C_SOURCE
+#define _XOPEN_SOURCE 700 // for crypt
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __GLIBC__
+#include <crypt.h>
+#endif
+#include "fake-auth.h"
+
+// The hash which shadow.c reads from the shadow entry as root, and which the
+// password checking child compares against
+extern char *encpw;
+
+bool fake_auth_setup(const struct fake_auth *config) {
+	const char *hash = crypt(config->password, config->setting);
+	if (!hash || hash[0] == '*') {
+		fprintf(stderr, "crypt() does not support the setting %s\n",
+			config->setting);
+		return false;
+	}
+	encpw = strdup(hash);
+	return encpw != NULL;
+}
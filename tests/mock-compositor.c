@@ -0,0 +1,1114 @@
+/*
+ * A compositor with only what swaylock needs to lock the session, without any
+ * display, which runs swaylock as its only client, types a script on its
+ * keyboard once the session is locked, and measures:
+ *
+ * - the time from starting swaylock to the session being locked, which is
+ *   once each output has a lock surface with a buffer;
+ * - the time from each key press to the next commit of a buffer;
+ * - the time from the last key press to the session being unlocked;
+ * - the memory used by swaylock, and the size of the buffers it has attached,
+ *   when it unlocks the session.
+ *
+ * Each commit is printed as a line of JSON, e.g.
+ *
+ *   {"commit":12,"us":48210,"surface":3,"role":"subsurface",
+ *    "buffer":"3840x2160","stride":15360,"format":1,"scale":2}
+ *
+ * where buffer is null if no buffer was attached since the previous commit,
+ * followed by a summary, e.g.
+ *
+ *   {"outputs":2,"size":"3840x2160","scale":2,"time_to_lock_us":81234,
+ *    "keys":21,"key_to_commit_us":1630,"key_to_commit_max_us":5120,
+ *    "unlock_us":2310,"rss_kb":61232,"hwm_kb":64120,
+ *    "buffer_bytes":66355200}
+ *
+ * where key_to_commit_us is the median over the key presses which were
+ * followed by a commit before the next one. It fails if swaylock does not lock
+ * and unlock the session before the timeout, or does not exit successfully.
+ *
+ * Subsurfaces are always desynchronized here, and buffers are held until
+ * another one is committed to the same surface.
+ *
+ * Usage: mock-compositor [options] -- <swaylock> [arguments...]
+ *
+ *   --outputs <n>      number of outputs (1)
+ *   --size <w>x<h>     mode of each output, in pixels (1920x1080)
+ *   --scale <n>        scale of each output (1)
+ *   --keys <path>      script typed once the session is locked
+ *   --interval <ms>    time between key presses (20)
+ *   --timeout <ms>     time allowed for the whole session (10000)
+ *
+ * Each line of the script is one of:
+ *
+ *   type <text>        presses and releases the key of each ASCII character,
+ *                      with Shift if needed
+ *   key <keysym>       presses and releases the key of a keysym, by name
+ *   wait <ms>          waits before the next line
+ *
+ * Blank lines and lines starting with # are ignored.
+ */
+#include <fcntl.h>
+#include <getopt.h>
+#include <signal.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+#include <wayland-server.h>
+#include <xkbcommon/xkbcommon.h>
+#include "ext-session-lock-v1-server-protocol.h"
+
+#define FRAME_MS 16
+
+struct mock_output {
+	int index;
+};
+
+struct buffer_ref {
+	struct wl_resource *resource;
+	struct wl_listener destroy;
+};
+
+struct mock_surface {
+	struct wl_resource *resource;
+	uint32_t id;
+	const char *role;
+	int32_t scale, pending_scale;
+	struct buffer_ref buffer, pending_buffer;
+	bool attached;
+	struct wl_list pending_frames; // wl_callback resources
+	struct mock_lock_surface *lock_surface;
+	struct wl_list link; // mock.surfaces
+};
+
+struct mock_lock_surface {
+	struct wl_resource *resource;
+	struct mock_surface *surface;
+	int output;
+	struct wl_list link; // mock.lock_surfaces
+};
+
+// A key press, or a wait if the keycode is 0
+struct action {
+	xkb_keycode_t keycode;
+	xkb_mod_mask_t mods;
+	int wait_ms;
+};
+
+static struct {
+	struct wl_display *display;
+	struct mock_output *output_list;
+	pid_t pid;
+	struct wl_listener client_destroy;
+
+	int outputs, width, height, scale;
+	int interval_ms, timeout_ms;
+
+	struct xkb_context *xkb_context;
+	struct xkb_keymap *keymap;
+	FILE *keymap_file;
+	uint32_t keymap_size;
+	xkb_mod_mask_t shift_mask;
+	struct action *actions;
+	size_t actions_len, next_action;
+
+	struct wl_event_source *key_timer, *frame_timer, *timeout_timer;
+	bool frame_scheduled;
+
+	struct wl_list keyboards; // wl_keyboard resources
+	struct wl_list frames; // committed wl_callback resources
+	struct wl_list surfaces;
+	struct wl_list lock_surfaces;
+	struct wl_resource *lock;
+	struct mock_surface *focus;
+	uint32_t surface_count, commits;
+
+	uint64_t start, locked_at, unlocked_at, last_key, pending_key;
+	uint64_t *latencies;
+	size_t keys, latencies_len;
+	long rss_kb, hwm_kb;
+	size_t buffer_bytes;
+	bool timed_out;
+} mock;
+
+static uint64_t now_us(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+static int compare_times(const void *a, const void *b) {
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void destroy_resource(struct wl_client *client,
+		struct wl_resource *resource) {
+	wl_resource_destroy(resource);
+}
+
+// For resources kept in a list by their link
+static void unlink_resource(struct wl_resource *resource) {
+	wl_list_remove(wl_resource_get_link(resource));
+}
+
+static void buffer_ref_handle_destroy(struct wl_listener *listener,
+		void *data) {
+	struct buffer_ref *ref = wl_container_of(listener, ref, destroy);
+	ref->resource = NULL;
+	wl_list_remove(&ref->destroy.link);
+}
+
+static void buffer_ref_set(struct buffer_ref *ref,
+		struct wl_resource *resource) {
+	if (ref->resource) {
+		wl_list_remove(&ref->destroy.link);
+	}
+	ref->resource = resource;
+	if (resource) {
+		ref->destroy.notify = buffer_ref_handle_destroy;
+		wl_resource_add_destroy_listener(resource, &ref->destroy);
+	}
+}
+
+static void read_memory(void) {
+	char path[64];
+	snprintf(path, sizeof(path), "/proc/%d/status", (int)mock.pid);
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		return;
+	}
+	char line[256];
+	while (fgets(line, sizeof(line), f)) {
+		sscanf(line, "VmRSS: %ld", &mock.rss_kb);
+		sscanf(line, "VmHWM: %ld", &mock.hwm_kb);
+	}
+	fclose(f);
+}
+
+static void send_key(const struct action *action) {
+	uint32_t time = now_us() / 1000;
+	struct wl_resource *keyboard;
+	wl_resource_for_each(keyboard, &mock.keyboards) {
+		if (action->mods) {
+			wl_keyboard_send_modifiers(keyboard,
+				wl_display_next_serial(mock.display), action->mods, 0, 0, 0);
+		}
+		// Wayland keycodes are evdev ones, which xkb ones are offset from
+		wl_keyboard_send_key(keyboard, wl_display_next_serial(mock.display),
+			time, action->keycode - 8, WL_KEYBOARD_KEY_STATE_PRESSED);
+		wl_keyboard_send_key(keyboard, wl_display_next_serial(mock.display),
+			time, action->keycode - 8, WL_KEYBOARD_KEY_STATE_RELEASED);
+		if (action->mods) {
+			wl_keyboard_send_modifiers(keyboard,
+				wl_display_next_serial(mock.display), 0, 0, 0, 0);
+		}
+	}
+	mock.last_key = mock.pending_key = now_us();
+	++mock.keys;
+}
+
+static int handle_key_timer(void *data) {
+	if (mock.next_action == mock.actions_len) {
+		return 0;
+	}
+	const struct action *action = &mock.actions[mock.next_action++];
+	if (action->keycode == 0) {
+		wl_event_source_timer_update(mock.key_timer, action->wait_ms);
+	} else {
+		send_key(action);
+		wl_event_source_timer_update(mock.key_timer, mock.interval_ms);
+	}
+	return 0;
+}
+
+static void focus_keyboard(struct wl_resource *keyboard) {
+	struct wl_array keys;
+	wl_array_init(&keys);
+	wl_keyboard_send_enter(keyboard, wl_display_next_serial(mock.display),
+		mock.focus->resource, &keys);
+	wl_array_release(&keys);
+	wl_keyboard_send_modifiers(keyboard, wl_display_next_serial(mock.display),
+		0, 0, 0, 0);
+}
+
+static void check_locked(void) {
+	if (!mock.lock || mock.locked_at) {
+		return;
+	}
+	int mapped = 0;
+	struct mock_lock_surface *lock_surface;
+	wl_list_for_each(lock_surface, &mock.lock_surfaces, link) {
+		if (lock_surface->surface && lock_surface->surface->buffer.resource) {
+			++mapped;
+		}
+	}
+	if (mapped < mock.outputs) {
+		return;
+	}
+
+	mock.locked_at = now_us();
+	ext_session_lock_v1_send_locked(mock.lock);
+
+	// The keyboard is on the first output
+	wl_list_for_each(lock_surface, &mock.lock_surfaces, link) {
+		if (lock_surface->output == 0) {
+			mock.focus = lock_surface->surface;
+		}
+	}
+	if (mock.focus) {
+		struct wl_resource *keyboard;
+		wl_resource_for_each(keyboard, &mock.keyboards) {
+			focus_keyboard(keyboard);
+		}
+	}
+	wl_event_source_timer_update(mock.key_timer, mock.interval_ms);
+}
+
+static int handle_frame_timer(void *data) {
+	mock.frame_scheduled = false;
+	uint32_t time = now_us() / 1000;
+	struct wl_resource *callback, *tmp;
+	wl_resource_for_each_safe(callback, tmp, &mock.frames) {
+		wl_callback_send_done(callback, time);
+		wl_resource_destroy(callback);
+	}
+	return 0;
+}
+
+static void print_commit(struct mock_surface *surface,
+		struct wl_resource *buffer) {
+	printf("{\"commit\":%u,\"us\":%llu,\"surface\":%u,\"role\":\"%s\",",
+		++mock.commits, (unsigned long long)(now_us() - mock.start),
+		surface->id, surface->role);
+	struct wl_shm_buffer *shm_buffer = buffer ? wl_shm_buffer_get(buffer) : NULL;
+	if (shm_buffer) {
+		printf("\"buffer\":\"%dx%d\",\"stride\":%d,\"format\":%u,",
+			wl_shm_buffer_get_width(shm_buffer),
+			wl_shm_buffer_get_height(shm_buffer),
+			wl_shm_buffer_get_stride(shm_buffer),
+			wl_shm_buffer_get_format(shm_buffer));
+	} else {
+		printf("\"buffer\":null,");
+	}
+	printf("\"scale\":%d}\n", surface->scale);
+}
+
+static void surface_attach(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *buffer,
+		int32_t x, int32_t y) {
+	struct mock_surface *surface = wl_resource_get_user_data(resource);
+	buffer_ref_set(&surface->pending_buffer, buffer);
+	surface->attached = true;
+}
+
+static void surface_damage(struct wl_client *client,
+		struct wl_resource *resource,
+		int32_t x, int32_t y, int32_t width, int32_t height) {
+	// Everything is drawn again anyway
+}
+
+static void surface_frame(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id) {
+	struct mock_surface *surface = wl_resource_get_user_data(resource);
+	struct wl_resource *callback = wl_resource_create(client,
+		&wl_callback_interface, 1, id);
+	if (!callback) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+	wl_resource_set_implementation(callback, NULL, NULL, unlink_resource);
+	wl_list_insert(surface->pending_frames.prev,
+		wl_resource_get_link(callback));
+}
+
+static void surface_set_region(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *region) {
+	// Nothing is composited
+}
+
+static void surface_commit(struct wl_client *client,
+		struct wl_resource *resource) {
+	struct mock_surface *surface = wl_resource_get_user_data(resource);
+	surface->scale = surface->pending_scale;
+
+	wl_list_insert_list(mock.frames.prev, &surface->pending_frames);
+	wl_list_init(&surface->pending_frames);
+	if (!wl_list_empty(&mock.frames) && !mock.frame_scheduled) {
+		wl_event_source_timer_update(mock.frame_timer, FRAME_MS);
+		mock.frame_scheduled = true;
+	}
+
+	if (!surface->attached) {
+		print_commit(surface, NULL);
+		return;
+	}
+	struct wl_resource *buffer = surface->pending_buffer.resource;
+	buffer_ref_set(&surface->pending_buffer, NULL);
+	surface->attached = false;
+	// The previous buffer is no longer shown
+	if (surface->buffer.resource && surface->buffer.resource != buffer) {
+		wl_buffer_send_release(surface->buffer.resource);
+	}
+	buffer_ref_set(&surface->buffer, buffer);
+	print_commit(surface, buffer);
+
+	if (buffer && mock.pending_key) {
+		uint64_t *latencies = realloc(mock.latencies,
+			(mock.latencies_len + 1) * sizeof(*latencies));
+		if (latencies) {
+			mock.latencies = latencies;
+			mock.latencies[mock.latencies_len++] = now_us() - mock.pending_key;
+		}
+		mock.pending_key = 0;
+	}
+	if (surface->lock_surface) {
+		check_locked();
+	}
+}
+
+static void surface_set_buffer_transform(struct wl_client *client,
+		struct wl_resource *resource, int32_t transform) {
+	// Only the normal transform is used
+}
+
+static void surface_set_buffer_scale(struct wl_client *client,
+		struct wl_resource *resource, int32_t scale) {
+	struct mock_surface *surface = wl_resource_get_user_data(resource);
+	surface->pending_scale = scale;
+}
+
+static const struct wl_surface_interface surface_impl = {
+	.destroy = destroy_resource,
+	.attach = surface_attach,
+	.damage = surface_damage,
+	.frame = surface_frame,
+	.set_opaque_region = surface_set_region,
+	.set_input_region = surface_set_region,
+	.commit = surface_commit,
+	.set_buffer_transform = surface_set_buffer_transform,
+	.set_buffer_scale = surface_set_buffer_scale,
+	.damage_buffer = surface_damage,
+};
+
+static void surface_handle_resource_destroy(struct wl_resource *resource) {
+	struct mock_surface *surface = wl_resource_get_user_data(resource);
+	struct wl_resource *callback, *tmp;
+	wl_resource_for_each_safe(callback, tmp, &surface->pending_frames) {
+		wl_resource_destroy(callback);
+	}
+	buffer_ref_set(&surface->buffer, NULL);
+	buffer_ref_set(&surface->pending_buffer, NULL);
+	if (surface->lock_surface) {
+		surface->lock_surface->surface = NULL;
+	}
+	if (mock.focus == surface) {
+		mock.focus = NULL;
+	}
+	wl_list_remove(&surface->link);
+	free(surface);
+}
+
+static void region_edit(struct wl_client *client, struct wl_resource *resource,
+		int32_t x, int32_t y, int32_t width, int32_t height) {
+	// Regions are not used
+}
+
+static const struct wl_region_interface region_impl = {
+	.destroy = destroy_resource,
+	.add = region_edit,
+	.subtract = region_edit,
+};
+
+static void compositor_create_surface(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id) {
+	struct mock_surface *surface = calloc(1, sizeof(*surface));
+	if (!surface) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+	surface->resource = wl_resource_create(client, &wl_surface_interface,
+		wl_resource_get_version(resource), id);
+	if (!surface->resource) {
+		free(surface);
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+	surface->id = ++mock.surface_count;
+	surface->role = "none";
+	surface->scale = surface->pending_scale = 1;
+	wl_list_init(&surface->pending_frames);
+	wl_list_insert(mock.surfaces.prev, &surface->link);
+	wl_resource_set_implementation(surface->resource, &surface_impl, surface,
+		surface_handle_resource_destroy);
+}
+
+static void compositor_create_region(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id) {
+	struct wl_resource *region = wl_resource_create(client,
+		&wl_region_interface, 1, id);
+	if (!region) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+	wl_resource_set_implementation(region, &region_impl, NULL, NULL);
+}
+
+static const struct wl_compositor_interface compositor_impl = {
+	.create_surface = compositor_create_surface,
+	.create_region = compositor_create_region,
+};
+
+static void bind_compositor(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	struct wl_resource *resource = wl_resource_create(client,
+		&wl_compositor_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &compositor_impl, NULL, NULL);
+}
+
+static void subsurface_set_position(struct wl_client *client,
+		struct wl_resource *resource, int32_t x, int32_t y) {
+	// Nothing is composited
+}
+
+static void subsurface_place(struct wl_client *client,
+		struct wl_resource *resource, struct wl_resource *sibling) {
+	// Nothing is composited
+}
+
+static void subsurface_set_sync(struct wl_client *client,
+		struct wl_resource *resource) {
+	// Commits are always applied at once
+}
+
+static const struct wl_subsurface_interface subsurface_impl = {
+	.destroy = destroy_resource,
+	.set_position = subsurface_set_position,
+	.place_above = subsurface_place,
+	.place_below = subsurface_place,
+	.set_sync = subsurface_set_sync,
+	.set_desync = subsurface_set_sync,
+};
+
+static void subcompositor_get_subsurface(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id,
+		struct wl_resource *surface_resource,
+		struct wl_resource *parent_resource) {
+	struct mock_surface *surface = wl_resource_get_user_data(surface_resource);
+	struct wl_resource *subsurface = wl_resource_create(client,
+		&wl_subsurface_interface, 1, id);
+	if (!subsurface) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+	wl_resource_set_implementation(subsurface, &subsurface_impl, NULL, NULL);
+	surface->role = "subsurface";
+}
+
+static const struct wl_subcompositor_interface subcompositor_impl = {
+	.destroy = destroy_resource,
+	.get_subsurface = subcompositor_get_subsurface,
+};
+
+static void bind_subcompositor(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	struct wl_resource *resource = wl_resource_create(client,
+		&wl_subcompositor_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &subcompositor_impl, NULL, NULL);
+}
+
+static void pointer_set_cursor(struct wl_client *client,
+		struct wl_resource *resource, uint32_t serial,
+		struct wl_resource *surface, int32_t hotspot_x, int32_t hotspot_y) {
+	// There is no pointer
+}
+
+static const struct wl_pointer_interface pointer_impl = {
+	.set_cursor = pointer_set_cursor,
+	.release = destroy_resource,
+};
+
+static const struct wl_keyboard_interface keyboard_impl = {
+	.release = destroy_resource,
+};
+
+static const struct wl_touch_interface touch_impl = {
+	.release = destroy_resource,
+};
+
+static void seat_get_pointer(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id) {
+	struct wl_resource *pointer = wl_resource_create(client,
+		&wl_pointer_interface, wl_resource_get_version(resource), id);
+	if (!pointer) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+	wl_resource_set_implementation(pointer, &pointer_impl, NULL, NULL);
+}
+
+static void seat_get_keyboard(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id) {
+	struct wl_resource *keyboard = wl_resource_create(client,
+		&wl_keyboard_interface, wl_resource_get_version(resource), id);
+	if (!keyboard) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+	wl_resource_set_implementation(keyboard, &keyboard_impl, NULL,
+		unlink_resource);
+	wl_list_insert(mock.keyboards.prev, wl_resource_get_link(keyboard));
+
+	wl_keyboard_send_keymap(keyboard, WL_KEYBOARD_KEYMAP_FORMAT_XKB_V1,
+		fileno(mock.keymap_file), mock.keymap_size);
+	if (wl_resource_get_version(keyboard) >=
+			WL_KEYBOARD_REPEAT_INFO_SINCE_VERSION) {
+		// Each key is released at once, so it never repeats
+		wl_keyboard_send_repeat_info(keyboard, 0, 0);
+	}
+	if (mock.locked_at && mock.focus) {
+		focus_keyboard(keyboard);
+	}
+}
+
+static void seat_get_touch(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id) {
+	struct wl_resource *touch = wl_resource_create(client,
+		&wl_touch_interface, wl_resource_get_version(resource), id);
+	if (!touch) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+	wl_resource_set_implementation(touch, &touch_impl, NULL, NULL);
+}
+
+static const struct wl_seat_interface seat_impl = {
+	.get_pointer = seat_get_pointer,
+	.get_keyboard = seat_get_keyboard,
+	.get_touch = seat_get_touch,
+	.release = destroy_resource,
+};
+
+static void bind_seat(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	struct wl_resource *resource = wl_resource_create(client,
+		&wl_seat_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &seat_impl, NULL, NULL);
+	wl_seat_send_capabilities(resource, WL_SEAT_CAPABILITY_KEYBOARD);
+	if (version >= WL_SEAT_NAME_SINCE_VERSION) {
+		wl_seat_send_name(resource, "seat0");
+	}
+}
+
+static const struct wl_output_interface output_impl = {
+	.release = destroy_resource,
+};
+
+static void bind_output(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	struct mock_output *output = data;
+	struct wl_resource *resource = wl_resource_create(client,
+		&wl_output_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &output_impl, output, NULL);
+
+	// Side by side
+	wl_output_send_geometry(resource,
+		output->index * (mock.width / mock.scale), 0, 0, 0,
+		WL_OUTPUT_SUBPIXEL_UNKNOWN, "swaylock", "mock",
+		WL_OUTPUT_TRANSFORM_NORMAL);
+	wl_output_send_mode(resource,
+		WL_OUTPUT_MODE_CURRENT | WL_OUTPUT_MODE_PREFERRED,
+		mock.width, mock.height, 60000);
+	if (version >= WL_OUTPUT_SCALE_SINCE_VERSION) {
+		wl_output_send_scale(resource, mock.scale);
+	}
+	if (version >= WL_OUTPUT_NAME_SINCE_VERSION) {
+		char name[32];
+		snprintf(name, sizeof(name), "MOCK-%d", output->index + 1);
+		wl_output_send_name(resource, name);
+	}
+	if (version >= WL_OUTPUT_DESCRIPTION_SINCE_VERSION) {
+		wl_output_send_description(resource, "Mock output");
+	}
+	if (version >= WL_OUTPUT_DONE_SINCE_VERSION) {
+		wl_output_send_done(resource);
+	}
+}
+
+static void lock_surface_ack_configure(struct wl_client *client,
+		struct wl_resource *resource, uint32_t serial) {
+	// The size never changes
+}
+
+static const struct ext_session_lock_surface_v1_interface lock_surface_impl = {
+	.destroy = destroy_resource,
+	.ack_configure = lock_surface_ack_configure,
+};
+
+static void lock_surface_handle_resource_destroy(struct wl_resource *resource) {
+	struct mock_lock_surface *lock_surface =
+		wl_resource_get_user_data(resource);
+	if (lock_surface->surface) {
+		lock_surface->surface->lock_surface = NULL;
+	}
+	wl_list_remove(&lock_surface->link);
+	free(lock_surface);
+}
+
+static void lock_get_lock_surface(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id,
+		struct wl_resource *surface_resource,
+		struct wl_resource *output_resource) {
+	struct mock_lock_surface *lock_surface =
+		calloc(1, sizeof(*lock_surface));
+	if (!lock_surface) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+	lock_surface->resource = wl_resource_create(client,
+		&ext_session_lock_surface_v1_interface, 1, id);
+	if (!lock_surface->resource) {
+		free(lock_surface);
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+	struct mock_output *output = wl_resource_get_user_data(output_resource);
+	lock_surface->output = output->index;
+	lock_surface->surface = wl_resource_get_user_data(surface_resource);
+	lock_surface->surface->lock_surface = lock_surface;
+	lock_surface->surface->role = "lock";
+	wl_list_insert(mock.lock_surfaces.prev, &lock_surface->link);
+	wl_resource_set_implementation(lock_surface->resource, &lock_surface_impl,
+		lock_surface, lock_surface_handle_resource_destroy);
+
+	ext_session_lock_surface_v1_send_configure(lock_surface->resource,
+		wl_display_next_serial(mock.display),
+		mock.width / mock.scale, mock.height / mock.scale);
+}
+
+static void lock_unlock_and_destroy(struct wl_client *client,
+		struct wl_resource *resource) {
+	if (mock.locked_at && !mock.unlocked_at) {
+		mock.unlocked_at = now_us();
+		read_memory();
+		struct mock_surface *surface;
+		wl_list_for_each(surface, &mock.surfaces, link) {
+			struct wl_shm_buffer *buffer = surface->buffer.resource ?
+				wl_shm_buffer_get(surface->buffer.resource) : NULL;
+			if (buffer) {
+				mock.buffer_bytes += (size_t)wl_shm_buffer_get_stride(buffer) *
+					wl_shm_buffer_get_height(buffer);
+			}
+		}
+	}
+	wl_resource_destroy(resource);
+}
+
+static const struct ext_session_lock_v1_interface lock_impl = {
+	.destroy = destroy_resource,
+	.get_lock_surface = lock_get_lock_surface,
+	.unlock_and_destroy = lock_unlock_and_destroy,
+};
+
+static void lock_handle_resource_destroy(struct wl_resource *resource) {
+	if (mock.lock == resource) {
+		mock.lock = NULL;
+	}
+}
+
+static void lock_manager_lock(struct wl_client *client,
+		struct wl_resource *resource, uint32_t id) {
+	struct wl_resource *lock = wl_resource_create(client,
+		&ext_session_lock_v1_interface, 1, id);
+	if (!lock) {
+		wl_resource_post_no_memory(resource);
+		return;
+	}
+	wl_resource_set_implementation(lock, &lock_impl, NULL,
+		lock_handle_resource_destroy);
+	if (mock.lock || mock.locked_at) {
+		ext_session_lock_v1_send_finished(lock);
+		return;
+	}
+	mock.lock = lock;
+}
+
+static const struct ext_session_lock_manager_v1_interface lock_manager_impl = {
+	.destroy = destroy_resource,
+	.lock = lock_manager_lock,
+};
+
+static void bind_lock_manager(struct wl_client *client, void *data,
+		uint32_t version, uint32_t id) {
+	struct wl_resource *resource = wl_resource_create(client,
+		&ext_session_lock_manager_v1_interface, version, id);
+	if (!resource) {
+		wl_client_post_no_memory(client);
+		return;
+	}
+	wl_resource_set_implementation(resource, &lock_manager_impl, NULL, NULL);
+}
+
+static bool init_keymap(void) {
+	mock.xkb_context = xkb_context_new(XKB_CONTEXT_NO_FLAGS);
+	if (!mock.xkb_context) {
+		fprintf(stderr, "Failed to create an xkb context\n");
+		return false;
+	}
+	// Not the one of the environment, so that the scripts always type the
+	// same keys
+	const struct xkb_rule_names names = {
+		.rules = "evdev",
+		.model = "pc105",
+		.layout = "us",
+	};
+	mock.keymap = xkb_keymap_new_from_names(mock.xkb_context, &names,
+		XKB_KEYMAP_COMPILE_NO_FLAGS);
+	if (!mock.keymap) {
+		fprintf(stderr, "Failed to compile the keymap\n");
+		return false;
+	}
+	mock.shift_mask =
+		1u << xkb_keymap_mod_get_index(mock.keymap, XKB_MOD_NAME_SHIFT);
+
+	char *keymap = xkb_keymap_get_as_string(mock.keymap,
+		XKB_KEYMAP_FORMAT_TEXT_V1);
+	if (!keymap) {
+		fprintf(stderr, "Failed to serialize the keymap\n");
+		return false;
+	}
+	mock.keymap_size = strlen(keymap) + 1;
+	// swaylock gets the keymap with wl_keyboard.keymap, not by inheriting it
+	mock.keymap_file = tmpfile();
+	bool written = mock.keymap_file &&
+		fcntl(fileno(mock.keymap_file), F_SETFD, FD_CLOEXEC) == 0 &&
+		fwrite(keymap, 1, mock.keymap_size, mock.keymap_file) ==
+			mock.keymap_size &&
+		fflush(mock.keymap_file) == 0;
+	free(keymap);
+	if (!written) {
+		fprintf(stderr, "Failed to write the keymap\n");
+		return false;
+	}
+	return true;
+}
+
+static bool add_action(struct action action) {
+	struct action *actions = realloc(mock.actions,
+		(mock.actions_len + 1) * sizeof(*actions));
+	if (!actions) {
+		fprintf(stderr, "Allocation failed\n");
+		return false;
+	}
+	mock.actions = actions;
+	mock.actions[mock.actions_len++] = action;
+	return true;
+}
+
+// Looks for the key of a keysym at the first level, then with Shift
+static bool add_key(xkb_keysym_t keysym) {
+	xkb_keycode_t min = xkb_keymap_min_keycode(mock.keymap);
+	xkb_keycode_t max = xkb_keymap_max_keycode(mock.keymap);
+	for (xkb_level_index_t level = 0; level < 2; ++level) {
+		for (xkb_keycode_t keycode = min; keycode <= max; ++keycode) {
+			const xkb_keysym_t *syms;
+			int n = xkb_keymap_key_get_syms_by_level(mock.keymap, keycode,
+				0, level, &syms);
+			if (n == 1 && syms[0] == keysym) {
+				return add_action((struct action){
+					.keycode = keycode,
+					.mods = level ? mock.shift_mask : 0,
+				});
+			}
+		}
+	}
+	return false;
+}
+
+static bool load_script(const char *path) {
+	FILE *f = fopen(path, "r");
+	if (!f) {
+		fprintf(stderr, "Failed to open %s\n", path);
+		return false;
+	}
+	char *line = NULL;
+	size_t size = 0;
+	int line_number = 0;
+	bool ok = true;
+	while (ok && getline(&line, &size, f) != -1) {
+		++line_number;
+		line[strcspn(line, "\n")] = '\0';
+		if (line[0] == '\0' || line[0] == '#') {
+			continue;
+		}
+		if (strncmp(line, "type ", 5) == 0) {
+			for (const char *c = line + 5; ok && *c; ++c) {
+				unsigned char ch = *c;
+				ok = ch < 0x80 && add_key(xkb_utf32_to_keysym(ch));
+			}
+		} else if (strncmp(line, "key ", 4) == 0) {
+			xkb_keysym_t keysym = xkb_keysym_from_name(line + 4,
+				XKB_KEYSYM_NO_FLAGS);
+			ok = keysym != XKB_KEY_NoSymbol && add_key(keysym);
+		} else if (strncmp(line, "wait ", 5) == 0) {
+			// The timers are disarmed with 0
+			int ms = atoi(line + 5);
+			ok = ms > 0 && add_action((struct action){ .wait_ms = ms });
+		} else {
+			ok = false;
+		}
+		if (!ok) {
+			fprintf(stderr, "%s:%d: invalid line: %s\n", path, line_number,
+				line);
+		}
+	}
+	free(line);
+	fclose(f);
+	return ok;
+}
+
+static void handle_client_destroy(struct wl_listener *listener, void *data) {
+	wl_display_terminate(mock.display);
+}
+
+static int handle_timeout(void *data) {
+	mock.timed_out = true;
+	kill(mock.pid, SIGTERM);
+	wl_display_terminate(mock.display);
+	return 0;
+}
+
+// swaylock connects to the socket given by WAYLAND_SOCKET, so that no
+// XDG_RUNTIME_DIR is needed
+static bool spawn_client(char **argv) {
+	int sockets[2];
+	if (socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sockets) != 0) {
+		perror("socketpair");
+		return false;
+	}
+	mock.start = now_us();
+	mock.pid = fork();
+	if (mock.pid < 0) {
+		perror("fork");
+		return false;
+	} else if (mock.pid == 0) {
+		// Unlike the original, the duplicate is inherited
+		int fd = dup(sockets[1]);
+		char value[16];
+		snprintf(value, sizeof(value), "%d", fd);
+		if (fd < 0 || setenv("WAYLAND_SOCKET", value, 1) != 0) {
+			_exit(127);
+		}
+		execvp(argv[0], argv);
+		perror("execvp");
+		_exit(127);
+	}
+	close(sockets[1]);
+
+	struct wl_client *client = wl_client_create(mock.display, sockets[0]);
+	if (!client) {
+		fprintf(stderr, "Failed to create the client\n");
+		close(sockets[0]);
+		kill(mock.pid, SIGTERM);
+		return false;
+	}
+	mock.client_destroy.notify = handle_client_destroy;
+	wl_client_add_destroy_listener(client, &mock.client_destroy);
+	return true;
+}
+
+static bool init_display(void) {
+	mock.display = wl_display_create();
+	if (!mock.display || wl_display_init_shm(mock.display) != 0) {
+		fprintf(stderr, "Failed to create the display\n");
+		return false;
+	}
+	wl_display_add_shm_format(mock.display, WL_SHM_FORMAT_RGB565);
+
+	mock.output_list = calloc(mock.outputs, sizeof(*mock.output_list));
+	if (!mock.output_list) {
+		fprintf(stderr, "Allocation failed\n");
+		return false;
+	}
+	for (int i = 0; i < mock.outputs; ++i) {
+		mock.output_list[i].index = i;
+		if (!wl_global_create(mock.display, &wl_output_interface, 4,
+				&mock.output_list[i], bind_output)) {
+			fprintf(stderr, "Failed to create the outputs\n");
+			return false;
+		}
+	}
+	if (!wl_global_create(mock.display, &wl_compositor_interface, 4,
+				NULL, bind_compositor) ||
+			!wl_global_create(mock.display, &wl_subcompositor_interface, 1,
+				NULL, bind_subcompositor) ||
+			!wl_global_create(mock.display, &wl_seat_interface, 4,
+				NULL, bind_seat) ||
+			!wl_global_create(mock.display,
+				&ext_session_lock_manager_v1_interface, 1,
+				NULL, bind_lock_manager)) {
+		fprintf(stderr, "Failed to create the globals\n");
+		return false;
+	}
+
+	struct wl_event_loop *loop = wl_display_get_event_loop(mock.display);
+	mock.key_timer = wl_event_loop_add_timer(loop, handle_key_timer, NULL);
+	mock.frame_timer = wl_event_loop_add_timer(loop, handle_frame_timer, NULL);
+	mock.timeout_timer = wl_event_loop_add_timer(loop, handle_timeout, NULL);
+	if (!mock.key_timer || !mock.frame_timer || !mock.timeout_timer) {
+		fprintf(stderr, "Failed to create the timers\n");
+		return false;
+	}
+	wl_event_source_timer_update(mock.timeout_timer, mock.timeout_ms);
+	return true;
+}
+
+static void print_summary(void) {
+	uint64_t median = 0, max = 0;
+	if (mock.latencies_len > 0) {
+		qsort(mock.latencies, mock.latencies_len, sizeof(uint64_t),
+			compare_times);
+		median = mock.latencies[mock.latencies_len / 2];
+		max = mock.latencies[mock.latencies_len - 1];
+	}
+	uint64_t unlock_from = mock.last_key ? mock.last_key : mock.locked_at;
+	printf("{\"outputs\":%d,\"size\":\"%dx%d\",\"scale\":%d,"
+		"\"time_to_lock_us\":%llu,\"keys\":%zu,\"key_to_commit_us\":%llu,"
+		"\"key_to_commit_max_us\":%llu,\"unlock_us\":%llu,\"rss_kb\":%ld,"
+		"\"hwm_kb\":%ld,\"buffer_bytes\":%zu}\n",
+		mock.outputs, mock.width, mock.height, mock.scale,
+		(unsigned long long)(mock.locked_at - mock.start), mock.keys,
+		(unsigned long long)median, (unsigned long long)max,
+		(unsigned long long)(mock.unlocked_at - unlock_from),
+		mock.rss_kb, mock.hwm_kb, mock.buffer_bytes);
+}
+
+static int usage(const char *name) {
+	fprintf(stderr, "Usage: %s [--outputs <n>] [--size <w>x<h>] "
+		"[--scale <n>] [--keys <path>] [--interval <ms>] [--timeout <ms>] "
+		"-- <swaylock> [arguments...]\n", name);
+	return EXIT_FAILURE;
+}
+
+int main(int argc, char **argv) {
+	static const struct option long_options[] = {
+		{"outputs", required_argument, NULL, 'o'},
+		{"size", required_argument, NULL, 's'},
+		{"scale", required_argument, NULL, 'S'},
+		{"keys", required_argument, NULL, 'k'},
+		{"interval", required_argument, NULL, 'i'},
+		{"timeout", required_argument, NULL, 't'},
+		{0, 0, 0, 0}
+	};
+
+	mock.outputs = 1;
+	mock.width = 1920;
+	mock.height = 1080;
+	mock.scale = 1;
+	mock.interval_ms = 20;
+	mock.timeout_ms = 10000;
+	mock.rss_kb = mock.hwm_kb = -1;
+	const char *keys = NULL;
+	int c;
+	while ((c = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+		switch (c) {
+		case 'o':
+			mock.outputs = atoi(optarg);
+			break;
+		case 's':
+			if (sscanf(optarg, "%dx%d", &mock.width, &mock.height) != 2) {
+				return usage(argv[0]);
+			}
+			break;
+		case 'S':
+			mock.scale = atoi(optarg);
+			break;
+		case 'k':
+			keys = optarg;
+			break;
+		case 'i':
+			mock.interval_ms = atoi(optarg);
+			break;
+		case 't':
+			mock.timeout_ms = atoi(optarg);
+			break;
+		default:
+			return usage(argv[0]);
+		}
+	}
+	if (optind == argc || mock.outputs <= 0 || mock.width <= 0 ||
+			mock.height <= 0 || mock.scale <= 0 || mock.interval_ms <= 0 ||
+			mock.timeout_ms <= 0) {
+		return usage(argv[0]);
+	}
+
+	wl_list_init(&mock.keyboards);
+	wl_list_init(&mock.frames);
+	wl_list_init(&mock.surfaces);
+	wl_list_init(&mock.lock_surfaces);
+	if (!init_keymap() || (keys && !load_script(keys)) || !init_display() ||
+			!spawn_client(&argv[optind])) {
+		return EXIT_FAILURE;
+	}
+
+	wl_display_run(mock.display);
+	wl_display_destroy_clients(mock.display);
+
+	int status;
+	if (waitpid(mock.pid, &status, 0) != mock.pid) {
+		perror("waitpid");
+		return EXIT_FAILURE;
+	}
+	bool success = true;
+	if (mock.timed_out) {
+		fprintf(stderr, "Timed out after %d ms\n", mock.timeout_ms);
+		success = false;
+	} else if (!WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+		fprintf(stderr, "swaylock did not exit successfully\n");
+		success = false;
+	} else if (!mock.locked_at || !mock.unlocked_at) {
+		fprintf(stderr, "The session was not %s\n",
+			mock.locked_at ? "unlocked" : "locked");
+		success = false;
+	} else if (mock.next_action < mock.actions_len) {
+		fprintf(stderr, "The session was unlocked before the end of the "
+			"script\n");
+		success = false;
+	}
+	if (success) {
+		print_summary();
+	}
+
+	wl_display_destroy(mock.display);
+	xkb_keymap_unref(mock.keymap);
+	xkb_context_unref(mock.xkb_context);
+	if (mock.keymap_file) {
+		fclose(mock.keymap_file);
+	}
+	free(mock.output_list);
+	free(mock.actions);
+	free(mock.latencies);
+	return success ? EXIT_SUCCESS : EXIT_FAILURE;
+}
@@ -0,0 +1,52 @@
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "offscreen.h"
+#include "swaylock.h"
+
+bool surface_shows_indicator(struct swaylock_surface *surface) {
+	return true;
+}
+
+void offscreen_init_state(struct swaylock_state *state) {
+	*state = (struct swaylock_state){0};
+	state->args = (struct swaylock_args){
+		.mode = BACKGROUND_MODE_FILL,
+		.font = strdup("sans-serif"),
+		.radius = 50,
+		.thickness = 10,
+		.show_indicator = true,
+		.show_caps_lock_text = true,
+		.ready_fd = -1,
+	};
+	set_default_colors(&state->args.colors);
+	wl_list_init(&state->surfaces);
+	wl_list_init(&state->images);
+	state->test_surface = cairo_image_surface_create(CAIRO_FORMAT_RGB24, 1, 1);
+	state->test_cairo = cairo_create(state->test_surface);
+}
+
+void offscreen_finish_state(struct swaylock_state *state) {
+	free(state->args.font);
+	cairo_destroy(state->test_cairo);
+	cairo_surface_destroy(state->test_surface);
+}
+
+void offscreen_init_surface(struct swaylock_surface *surface,
+		struct swaylock_state *state, uint32_t width, uint32_t height,
+		int32_t scale) {
+	*surface = (struct swaylock_surface){
+		.state = state,
+		.width = width,
+		.height = height,
+		.scale = scale,
+		.subpixel = WL_OUTPUT_SUBPIXEL_UNKNOWN,
+	};
+	wl_list_insert(state->surfaces.prev, &surface->link);
+}
+
+uint64_t offscreen_time(void) {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+}
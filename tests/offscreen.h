@@ -0,0 +1,23 @@
+#ifndef _SWAYLOCK_TESTS_OFFSCREEN_H
+#define _SWAYLOCK_TESTS_OFFSCREEN_H
+#include <stdint.h>
+#include "swaylock.h"
+
+/*
+ * A swaylock state and surfaces which are drawn into plain cairo image
+ * surfaces, without a compositor. render.c is linked as is, and the functions
+ * it uses from main.c, which cannot be linked, are provided here.
+ */
+
+// Sets up the state with swaylock's default options
+void offscreen_init_state(struct swaylock_state *state);
+void offscreen_finish_state(struct swaylock_state *state);
+// Sets up a surface for an output of the given logical size and scale
+void offscreen_init_surface(struct swaylock_surface *surface,
+	struct swaylock_state *state, uint32_t width, uint32_t height,
+	int32_t scale);
+
+// CLOCK_MONOTONIC, in nanoseconds
+uint64_t offscreen_time(void);
+
+#endif
@@ -0,0 +1,360 @@
+/*
+ * Replays a recorded trace of key presses and authentication results into
+ * swaylock_handle_key() and the timers of password.c, on a virtual clock, and
+ * draws the indicator offscreen after each event.
+ *
+ * Usage: replay <trace>
+ *
+ * Each line of the trace is one of the following, with times in milliseconds
+ * from the start of the trace:
+ *
+ *   option backoff <mode>
+ *   option ignore-empty-password
+ *   <time> key <keysym> <codepoint> [ctrl] [caps]
+ *   <time> auth success|failure
+ *   <time> wait
+ *   expect <name>=<value>...
+ *
+ * keysym is an xkbcommon keysym name, and codepoint is in hexadecimal, or -
+ * for none. auth gives the result of the password being checked, and wait only
+ * lets the timers run until then. Key repeat is recorded as the repeated key
+ * presses. Empty lines and lines starting with # are ignored.
+ *
+ * Each event, and each time timers expire, is printed as a line of JSON with
+ * the time taken to handle it and to draw the indicator, and the state which
+ * results, followed by a line with the totals and the final state. Once the
+ * trace is over, the state is checked against the expect lines, whose names
+ * are auth, input, len, queued, submitted, failed and unlocked. The exit
+ * status is 1 if any does not match, and 2 if the trace is invalid.
+ */
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <xkbcommon/xkbcommon.h>
+#include "comm.h"
+#include "loop.h"
+#include "offscreen.h"
+#include "password-buffer.h"
+#include "swaylock.h"
+
+#define EXPECT_MAX 16
+
+static const char *auth_names[] = {
+	[AUTH_STATE_IDLE] = "idle",
+	[AUTH_STATE_VALIDATING] = "validating",
+	[AUTH_STATE_INVALID] = "invalid",
+};
+
+static const char *input_names[] = {
+	[INPUT_STATE_IDLE] = "idle",
+	[INPUT_STATE_CLEAR] = "clear",
+	[INPUT_STATE_LETTER] = "letter",
+	[INPUT_STATE_BACKSPACE] = "backspace",
+	[INPUT_STATE_NEUTRAL] = "neutral",
+};
+
+static struct swaylock_state state;
+static struct swaylock_surface surface;
+static cairo_surface_t *layers[INDICATOR_LAYER_COUNT];
+
+// The virtual clock, in nanoseconds. It starts at an arbitrary time, so that
+// nothing relies on it starting at 0.
+static const uint64_t start_time = 1000000000;
+static uint64_t now_ns = start_time;
+
+static int submitted = 0;
+static bool unlocked = false;
+static int events = 0;
+static uint64_t total_handle_ns = 0, total_render_ns = 0;
+
+static void get_virtual_time(struct timespec *now, void *data) {
+	now->tv_sec = now_ns / 1000000000;
+	now->tv_nsec = now_ns % 1000000000;
+}
+
+// The indicator is drawn once the event is handled, as swaylock does on the
+// next frame callback
+void damage_state(struct swaylock_state *state) {
+	surface.dirty = true;
+}
+
+uint64_t get_comm_time(void) {
+	return now_ns / 1000;
+}
+
+// The result of the check comes from an auth line of the trace
+uint32_t write_comm_request(struct swaylock_password *pw) {
+	clear_password_buffer(pw);
+	return ++submitted;
+}
+
+static uint64_t draw(void) {
+	if (!surface.dirty) {
+		return 0;
+	}
+	uint64_t start = offscreen_time();
+	render_indicator_layers(&surface, layers);
+	surface.dirty = false;
+	return offscreen_time() - start;
+}
+
+static void print_state(void) {
+	printf("\"auth\":\"%s\",\"input\":\"%s\",\"len\":%zu,\"queued\":%d,"
+		"\"submitted\":%d,\"failed\":%d,\"unlocked\":%d",
+		auth_names[state.auth_state], input_names[state.input_state],
+		state.password.len, state.password_queued, submitted,
+		state.failed_attempts, unlocked);
+}
+
+static void print_event(const char *event, uint64_t handle_ns) {
+	uint64_t render_ns = draw();
+	++events;
+	total_handle_ns += handle_ns;
+	total_render_ns += render_ns;
+	printf("{\"time\":%.3f,\"event\":\"%s\",\"handle_ns\":%llu,"
+		"\"render_ns\":%llu,", (double)(now_ns - start_time) / 1000000,
+		event, (unsigned long long)handle_ns, (unsigned long long)render_ns);
+	print_state();
+	printf("}\n");
+}
+
+// Runs the timers which expire before the given time, in the order in which
+// they expire, and moves the clock to it
+static void advance(uint64_t time_ns) {
+	struct timespec expiry;
+	while (loop_next_timer(state.eventloop, &expiry)) {
+		uint64_t expiry_ns = (uint64_t)expiry.tv_sec * 1000000000 +
+			expiry.tv_nsec;
+		if (expiry_ns >= time_ns) {
+			break;
+		}
+		// Timers expire once the clock is past their expiry
+		now_ns = expiry_ns + 1;
+		uint64_t start = offscreen_time();
+		loop_poll(state.eventloop);
+		print_event("timer", offscreen_time() - start);
+	}
+	now_ns = time_ns;
+}
+
+static void handle_key(char *args, int line_no) {
+	char *name = strtok(args, " \t");
+	char *codepoint_str = strtok(NULL, " \t");
+	if (!name || !codepoint_str) {
+		fprintf(stderr, "line %d: expected a keysym and a codepoint\n", line_no);
+		exit(2);
+	}
+	xkb_keysym_t keysym = xkb_keysym_from_name(name, XKB_KEYSYM_NO_FLAGS);
+	if (keysym == XKB_KEY_NoSymbol) {
+		fprintf(stderr, "line %d: unknown keysym %s\n", line_no, name);
+		exit(2);
+	}
+	uint32_t codepoint = strcmp(codepoint_str, "-") == 0 ? 0 :
+		strtoul(codepoint_str, NULL, 16);
+
+	state.xkb.control = false;
+	state.xkb.caps_lock = false;
+	char *mod;
+	while ((mod = strtok(NULL, " \t"))) {
+		if (strcmp(mod, "ctrl") == 0) {
+			state.xkb.control = true;
+		} else if (strcmp(mod, "caps") == 0) {
+			state.xkb.caps_lock = true;
+		} else {
+			fprintf(stderr, "line %d: unknown modifier %s\n", line_no, mod);
+			exit(2);
+		}
+	}
+
+	uint64_t start = offscreen_time();
+	swaylock_handle_key(&state, keysym, codepoint);
+	print_event("key", offscreen_time() - start);
+}
+
+// As swaylock does with the result of the request in progress
+static void handle_auth(char *args, int line_no) {
+	char *result = strtok(args, " \t");
+	if (state.auth_state != AUTH_STATE_VALIDATING) {
+		fprintf(stderr, "line %d: no password is being checked\n", line_no);
+		exit(2);
+	}
+	uint64_t start = offscreen_time();
+	if (result && strcmp(result, "success") == 0) {
+		unlocked = true;
+	} else if (result && strcmp(result, "failure") == 0) {
+		++state.failed_attempts;
+		handle_auth_failure(&state);
+		damage_state(&state);
+	} else {
+		fprintf(stderr, "line %d: expected success or failure\n", line_no);
+		exit(2);
+	}
+	print_event("auth", offscreen_time() - start);
+}
+
+static void handle_option(char *args, int line_no) {
+	char *name = strtok(args, " \t");
+	char *value = strtok(NULL, " \t");
+	if (name && strcmp(name, "backoff") == 0 && value) {
+		state.args.backoff = parse_backoff_mode(value);
+		if (state.args.backoff != BACKOFF_MODE_INVALID) {
+			return;
+		}
+	} else if (name && strcmp(name, "ignore-empty-password") == 0) {
+		state.args.ignore_empty = true;
+		return;
+	}
+	fprintf(stderr, "line %d: invalid option\n", line_no);
+	exit(2);
+}
+
+static bool check_expected(const char *expected) {
+	char name[32], value[32];
+	if (sscanf(expected, "%31[^=]=%31s", name, value) != 2) {
+		fprintf(stderr, "invalid expectation %s\n", expected);
+		exit(2);
+	}
+	char actual[32];
+	if (strcmp(name, "auth") == 0) {
+		snprintf(actual, sizeof(actual), "%s", auth_names[state.auth_state]);
+	} else if (strcmp(name, "input") == 0) {
+		snprintf(actual, sizeof(actual), "%s", input_names[state.input_state]);
+	} else if (strcmp(name, "len") == 0) {
+		snprintf(actual, sizeof(actual), "%zu", state.password.len);
+	} else if (strcmp(name, "queued") == 0) {
+		snprintf(actual, sizeof(actual), "%d", state.password_queued);
+	} else if (strcmp(name, "submitted") == 0) {
+		snprintf(actual, sizeof(actual), "%d", submitted);
+	} else if (strcmp(name, "failed") == 0) {
+		snprintf(actual, sizeof(actual), "%d", state.failed_attempts);
+	} else if (strcmp(name, "unlocked") == 0) {
+		snprintf(actual, sizeof(actual), "%d", unlocked);
+	} else {
+		fprintf(stderr, "unknown expectation %s\n", name);
+		exit(2);
+	}
+	if (strcmp(actual, value) != 0) {
+		fprintf(stderr, "expected %s=%s, got %s\n", name, value, actual);
+		return false;
+	}
+	return true;
+}
+
+static bool init_password(struct swaylock_password *pw) {
+	pw->len = 0;
+	pw->buffer_len = 256;
+	pw->buffer = password_buffer_create(pw->buffer_len);
+	if (!pw->buffer) {
+		return false;
+	}
+	pw->buffer[0] = 0;
+	return true;
+}
+
+int main(int argc, char **argv) {
+	if (argc != 2) {
+		fprintf(stderr, "Usage: %s <trace>\n", argv[0]);
+		return 2;
+	}
+	FILE *f = fopen(argv[1], "r");
+	if (!f) {
+		perror(argv[1]);
+		return 2;
+	}
+
+	offscreen_init_state(&state);
+	state.args.backoff = BACKOFF_MODE_NONE;
+	state.eventloop = loop_create();
+	loop_set_clock(state.eventloop, get_virtual_time, NULL);
+	if (!password_buffer_init() || !init_password(&state.password) ||
+			!init_password(&state.queued_password)) {
+		fprintf(stderr, "Failed to allocate the password buffers\n");
+		return 2;
+	}
+	offscreen_init_surface(&surface, &state, 1920, 1080, 1);
+
+	char *expected[EXPECT_MAX];
+	int expected_count = 0;
+	uint64_t last_time = 0;
+	char line[512];
+	int line_no = 0;
+	while (fgets(line, sizeof(line), f)) {
+		++line_no;
+		line[strcspn(line, "\r\n")] = 0;
+		char *args = line + strspn(line, " \t");
+		if (*args == 0 || *args == '#') {
+			continue;
+		}
+		if (strncmp(args, "option ", 7) == 0) {
+			handle_option(args + 7, line_no);
+			continue;
+		}
+		if (strncmp(args, "expect ", 7) == 0) {
+			char *item = strtok(args + 7, " \t");
+			for (; item; item = strtok(NULL, " \t")) {
+				if (expected_count == EXPECT_MAX) {
+					fprintf(stderr, "line %d: too many expectations\n", line_no);
+					return 2;
+				}
+				expected[expected_count++] = strdup(item);
+			}
+			continue;
+		}
+
+		char *end;
+		double time_ms = strtod(args, &end);
+		uint64_t time = (uint64_t)(time_ms * 1000000);
+		if (end == args || time < last_time) {
+			fprintf(stderr, "line %d: expected a time after the last one\n",
+				line_no);
+			return 2;
+		}
+		last_time = time;
+		char *event = strtok(end, " \t");
+		char *event_args = strtok(NULL, "");
+		if (!event) {
+			fprintf(stderr, "line %d: expected an event\n", line_no);
+			return 2;
+		} else if (unlocked) {
+			// swaylock exits once unlocked
+			continue;
+		}
+
+		advance(start_time + time);
+		if (strcmp(event, "key") == 0) {
+			handle_key(event_args ? event_args : "", line_no);
+		} else if (strcmp(event, "auth") == 0) {
+			handle_auth(event_args ? event_args : "", line_no);
+		} else if (strcmp(event, "wait") != 0) {
+			fprintf(stderr, "line %d: unknown event %s\n", line_no, event);
+			return 2;
+		}
+	}
+	fclose(f);
+
+	printf("{\"events\":%d,\"handle_ns\":%llu,\"render_ns\":%llu,", events,
+		(unsigned long long)total_handle_ns,
+		(unsigned long long)total_render_ns);
+	print_state();
+	printf("}\n");
+
+	bool ok = true;
+	for (int i = 0; i < expected_count; ++i) {
+		ok = check_expected(expected[i]) && ok;
+		free(expected[i]);
+	}
+
+	for (int i = 0; i < INDICATOR_LAYER_COUNT; ++i) {
+		cairo_surface_destroy(layers[i]);
+	}
+	wl_list_remove(&surface.link);
+	password_buffer_destroy(state.password.buffer, state.password.buffer_len);
+	password_buffer_destroy(state.queued_password.buffer,
+		state.queued_password.buffer_len);
+	loop_destroy(state.eventloop);
+	offscreen_finish_state(&state);
+	return ok ? 0 : 1;
+}
@@ -0,0 +1,155 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include "log.h"
+#include "trace.h"
+
+// Must be a power of two
+#define TRACE_RING_SIZE 8192
+
+struct trace_event {
+	uint64_t timestamp; // nanoseconds, CLOCK_MONOTONIC
+	const char *name;
+	char phase; // 'B', 'E' or 'i', as in the trace-event format
+};
+
+static struct trace_event ring[TRACE_RING_SIZE];
+static uint64_t ring_head = 0; // number of events ever recorded
+static uint64_t ring_dumped = 0; // number of events already written out
+static bool enabled = false;
+static int trace_fd = -1;
+static pid_t trace_pid = 0;
+
+static void record(const char *name, char phase) {
+	if (!enabled) {
+		return;
+	}
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	struct trace_event *event = &ring[ring_head & (TRACE_RING_SIZE - 1)];
+	event->timestamp = (uint64_t)now.tv_sec * 1000000000 + now.tv_nsec;
+	event->name = name;
+	event->phase = phase;
+	++ring_head;
+}
+
+void trace_begin(const char *name) {
+	record(name, 'B');
+}
+
+void trace_end(const char *name) {
+	record(name, 'E');
+}
+
+void trace_instant(const char *name) {
+	record(name, 'i');
+}
+
+static bool write_full(int fd, const char *buf, size_t size) {
+	while (size > 0) {
+		ssize_t n = write(fd, buf, size);
+		if (n < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return false;
+		}
+		buf += n;
+		size -= n;
+	}
+	return true;
+}
+
+void trace_dump(void) {
+	if (!enabled || getpid() != trace_pid) {
+		return;
+	}
+
+	uint64_t start = ring_dumped;
+	if (ring_head - start > TRACE_RING_SIZE) {
+		swaylock_log(LOG_ERROR, "Trace ring overflowed, %llu events lost",
+			(unsigned long long)(ring_head - start - TRACE_RING_SIZE));
+		start = ring_head - TRACE_RING_SIZE;
+	}
+
+	// Only complete lines are ever written, so that the appends from
+	// swaylock and its child do not interleave within an event
+	char buf[4096];
+	size_t len = 0;
+	for (uint64_t i = start; i < ring_head; ++i) {
+		const struct trace_event *event = &ring[i & (TRACE_RING_SIZE - 1)];
+		char line[256];
+		int n = snprintf(line, sizeof(line),
+			"{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%llu.%03u,"
+			"\"pid\":%d,\"tid\":%d%s},\n",
+			event->name, event->phase,
+			(unsigned long long)(event->timestamp / 1000),
+			(unsigned)(event->timestamp % 1000),
+			(int)trace_pid, (int)trace_pid,
+			event->phase == 'i' ? ",\"s\":\"p\"" : "");
+		if (n < 0 || (size_t)n >= sizeof(line)) {
+			continue;
+		}
+		if (len + n > sizeof(buf)) {
+			if (!write_full(trace_fd, buf, len)) {
+				swaylock_log_errno(LOG_ERROR, "Failed to write trace");
+				return;
+			}
+			len = 0;
+		}
+		memcpy(&buf[len], line, n);
+		len += n;
+	}
+	if (len > 0 && !write_full(trace_fd, buf, len)) {
+		swaylock_log_errno(LOG_ERROR, "Failed to write trace");
+		return;
+	}
+	ring_dumped = ring_head;
+}
+
+void trace_init(void) {
+	const char *path = getenv("SWAYLOCK_TRACE");
+	if (!path || path[0] == '\0') {
+		return;
+	}
+	if (getuid() != geteuid() || getgid() != getegid()) {
+		swaylock_log(LOG_ERROR, "Ignoring SWAYLOCK_TRACE: swaylock is setuid");
+		return;
+	}
+
+	// The JSON array format allows the closing bracket to be omitted, so
+	// each process can simply append its events when it dumps them
+	trace_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC,
+		0600);
+	if (trace_fd < 0) {
+		swaylock_log_errno(LOG_ERROR, "Unable to open trace file %s", path);
+		return;
+	}
+	if (!write_full(trace_fd, "[\n", 2)) {
+		swaylock_log_errno(LOG_ERROR, "Failed to write trace");
+		close(trace_fd);
+		trace_fd = -1;
+		return;
+	}
+
+	trace_pid = getpid();
+	enabled = true;
+	atexit(trace_dump);
+	swaylock_log(LOG_DEBUG, "Tracing to %s", path);
+}
+
+bool trace_enabled(void) {
+	return enabled;
+}
+
+void trace_fork(void) {
+	trace_pid = getpid();
+	ring_head = 0;
+	ring_dumped = 0;
+}